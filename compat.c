@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
 int
 pledge(const char *promises, const char *execpromises)
 {
@@ -9,3 +13,38 @@ unveil(const char *path, const char *permissions)
 {
 	return 0;
 }
+
+long long
+strtonum(const char *numstr, long long minval, long long maxval,
+    const char **errstrp)
+{
+	long long ll = 0;
+	char *ep;
+	int error = 0;
+
+	errno = 0;
+	if (minval > maxval) {
+		error = EINVAL;
+	} else {
+		ll = strtoll(numstr, &ep, 10);
+		if (numstr == ep || *ep != '\0')
+			error = EINVAL;
+		else if ((ll == LLONG_MIN && errno == ERANGE) || ll < minval)
+			error = ERANGE;
+		else if ((ll == LLONG_MAX && errno == ERANGE) || ll > maxval)
+			error = ERANGE;
+	}
+	if (errstrp != NULL) {
+		if (error == EINVAL)
+			*errstrp = "invalid";
+		else if (error == ERANGE)
+			*errstrp = ll < minval ? "too small" : "too large";
+		else
+			*errstrp = NULL;
+	}
+	errno = error;
+	if (error)
+		ll = 0;
+
+	return ll;
+}
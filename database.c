@@ -64,12 +64,22 @@
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "database.h"
 #include "dict.h"
@@ -82,28 +92,203 @@
 #define COMMENT      0x10 /* bit 4 set: file comment present */
 #define RESERVED     0xE0 /* bits 5..7: reserved */
 
+#define DEFAULT_CACHE	8   /* inflated chunks kept by default */
+#define INFLATE_STEP	4096	/* granularity of inflating part of a chunk */
+
+/* seekable format of zstd, also used for chunked LZ4 */
+#define SEEK_SKIPPABLE	0x184D2A5E
+#define SEEK_MAGIC	0x8F92EAB1
+#define SEEK_FOOTER	9
+#define SEEK_CHUNK_MAX	(16 * 1024 * 1024)
+#define ZSTD_FRAME	0xFD2FB528
+#define LZ4_FRAME	0x184D2204
+
+#define PLAIN_CHUNK	65536	/* chunks of uncompressed databases */
+
+#define TEXT_MAGIC	"DCTX"
+#define TEXT_VERSION	1
+
+#define SHM_MAGIC	0x64637368
+#define SHM_ALIGN	64
+#define SHM_HDRLEN	((sizeof(struct gz_shm) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1))
+
+struct gz_chunk {
+	u_int8_t		*buf;		/* ra_clen bytes */
+	size_t			 len;		/* inflated length */
+	size_t			 chunk;
+	int			 partial;	/* inflating stopped early */
+	TAILQ_ENTRY(gz_chunk)	 lru;
+};
+
+/*
+ * Header of a shared memory segment with inflated chunks, filled in by
+ * the process creating it.  The segment is named after the path of
+ * the database, the device, inode, size and mtime of the file tell a
+ * stale segment.
+ */
+struct gz_shm {
+	u_int32_t	magic;		/* stored last */
+	u_int32_t	clen;
+	u_int64_t	dev;
+	u_int64_t	ino;
+	u_int64_t	size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	u_int64_t	nslots;
+};
+
+/*
+ * A chunk is stored in the slot of its number modulo the number of
+ * slots.  Writers make seq odd while they change the slot, readers
+ * copy the chunk out and take it as a miss if seq changed meanwhile.
+ */
+struct gz_shm_slot {
+	u_int32_t	seq;
+	u_int32_t	chunk;		/* plus one, 0 if empty */
+	u_int32_t	len;
+	u_int32_t	pad;
+	/* clen bytes */
+};
+
+/*
+ * Header of a materialized database, the plain text of a compressed
+ * one.  It is only used while the compressed file is unchanged.
+ */
+struct gz_text {
+	char		magic[4];
+	u_int32_t	version;
+	u_int64_t	src_dev;
+	u_int64_t	src_ino;
+	u_int64_t	src_size;
+	int64_t		src_sec;
+	int64_t		src_nsec;
+	u_int64_t	len;
+};
+
+/*
+ * Chunks are taken by the materializing threads in turn.
+ */
+struct gz_materialize {
+	const struct dc_database *db;
+	u_char		*out;
+	size_t		 nchunks;	/* all but the last one */
+	size_t		 next;
+	int		 error;
+};
+
+/*
+ * The mapped file and its chunk table are only read after opening, so
+ * one gz_stream is shared by every reader.
+ */
 typedef
 struct gz_stream {
 	int		 z_eof;		/* set if end of input file */
-	z_stream	 z_stream;	/* libz stream */
-	u_char		*z_buf;		/* i/o buffer */
+	u_char		*z_buf;		/* mapped file */
 	size_t		 z_buflen;
+	const u_char	*z_next;	/* header parsing position */
+	size_t		 z_avail;
 	u_int32_t	 z_hlen;	/* length of the gz header */
-	u_int16_t	 ra_clen;
-	u_int16_t	 ra_ccount;
-	u_int16_t	*ra_chunks;
+	u_int32_t	 ra_clen;
+	size_t		 ra_ccount;
+	u_int32_t	*ra_chunks;
 	u_int64_t	*ra_offset;
-	u_int8_t	*o_buf;		/* to keep a single ra_clen buffer */
+	const struct gz_codec *codec;
+	struct dc_reader *reader;	/* the one of database_stream() */
+	u_char		*shm;		/* shared chunks or NULL */
+	size_t		 shm_len;
+	size_t		 shm_nslots;
+	size_t		 shm_stride;
 } gz_stream;
 
+/*
+ * The inflater and chunk cache of one thread.
+ */
+struct dc_reader {
+	const gz_stream	*s;
+	z_stream	 z_stream;	/* libz stream */
+	void		*z_ctx;		/* of the other codecs */
+	struct gz_chunk	*z_resume;	/* partial chunk of z_stream */
+	size_t		 z_need;	/* bytes of the chunk read next */
+	struct gz_chunk	*c_slots;	/* inflated chunks */
+	size_t		 c_size;
+	struct gz_chunk	**c_map;	/* chunk number to slot */
+	TAILQ_HEAD(gz_chunk_lru, gz_chunk) c_lru;	/* most recently used first */
+	u_int64_t	 c_hits;
+	u_int64_t	 c_misses;
+	u_int64_t	 c_shared;	/* misses found in shared memory */
+	u_int64_t	 z_in;
+	u_int64_t	 z_out;
+	u_int64_t	 z_ns;		/* only with dc_stats_enabled */
+};
+
+/*
+ * All formats are split into chunks that are compressed on their own.
+ * The codec finds them when the file is opened and decompresses them,
+ * init and fini may be NULL if readers need no state.  chunk returns
+ * the compressed bytes consumed.  It may stop once the first z_need
+ * bytes are there and mark the chunk partial.
+ */
+struct gz_codec {
+	int	(*open)(gz_stream *);
+	int	(*init)(struct dc_reader *);
+	void	(*fini)(struct dc_reader *);
+	ssize_t	(*chunk)(struct dc_reader *, size_t, struct gz_chunk *);
+};
+
 static const u_char gz_magic[2] = {0x1f, 0x8b}; /* gzip magic header */
 
 static u_int16_t get_int16(gz_stream *);
 static int get_header(gz_stream *);
 static int get_byte(gz_stream *);
 static gz_stream *gz_ropen(int);
-static int gz_read(void *, size_t, char *, size_t);
-static int gz_close(void *);
+static int gz_cache(struct dc_reader *, size_t);
+static int gz_read(struct dc_reader *, size_t, size_t, database_fn, void *);
+static int gz_close(gz_stream *);
+static struct gz_chunk *gz_chunk(struct dc_reader *, size_t, size_t);
+static int gz_open_header(gz_stream *);
+static int gz_init(struct dc_reader *);
+static void gz_fini(struct dc_reader *);
+static ssize_t gz_inflate(struct dc_reader *, size_t, struct gz_chunk *);
+#ifdef HAVE_ZSTD
+static int zstd_open(gz_stream *);
+static int zstd_init(struct dc_reader *);
+static void zstd_fini(struct dc_reader *);
+static ssize_t zstd_chunk(struct dc_reader *, size_t, struct gz_chunk *);
+#endif
+#ifdef HAVE_LZ4
+static int lz4_open(gz_stream *);
+static int lz4_init(struct dc_reader *);
+static void lz4_fini(struct dc_reader *);
+static ssize_t lz4_chunk(struct dc_reader *, size_t, struct gz_chunk *);
+#endif
+static int plain_open(gz_stream *);
+static int plain_table(gz_stream *, size_t);
+static ssize_t plain_chunk(struct dc_reader *, size_t, struct gz_chunk *);
+
+static const struct gz_codec gz_codecs[] = {
+	{ gz_open_header,	gz_init,	gz_fini,	gz_inflate },
+#ifdef HAVE_ZSTD
+	{ zstd_open,		zstd_init,	zstd_fini,	zstd_chunk },
+#endif
+#ifdef HAVE_LZ4
+	{ lz4_open,		lz4_init,	lz4_fini,	lz4_chunk },
+#endif
+	{ plain_open,		NULL,		NULL,		plain_chunk },
+};
+#define PLAIN_CODEC	(&gz_codecs[sizeof(gz_codecs) / sizeof(gz_codecs[0]) - 1])
+
+/* tried by dict_open() in this order, uncompressed and converted first */
+const char *const database_suffixes[] = {
+	".dict",
+#ifdef HAVE_ZSTD
+	".dict.zst",
+#endif
+#ifdef HAVE_LZ4
+	".dict.lz4",
+#endif
+	".dict.dz",
+	NULL
+};
 
 int
 database_open(int fd, struct dc_database *db)
@@ -113,32 +298,502 @@ database_open(int fd, struct dc_database *db)
 		return -1;
 
 	db->data = s;
-	db->size = s->ra_clen * s->ra_ccount;
+	db->size = (off_t)s->ra_clen * s->ra_ccount;
 
 	return 0;
 }
 
+void
+database_close(struct dc_database *db)
+{
+	if (db->data != NULL)
+		(void)gz_close(db->data);
+	db->data = NULL;
+}
+
 int
-database_lookup(struct dc_index_entry *req, struct dc_database *db, char *out)
+database_cache(struct dc_database *db, size_t nchunks)
 {
-	if (gz_read(db->data, req->def_off, out, req->def_len) == -1)
+	const gz_stream *s = db->data;
+
+	return gz_cache(s->reader, nchunks);
+}
+
+void
+database_stats(const struct dc_database *db, struct dc_stats *st)
+{
+	const gz_stream *s = db->data;
+
+	database_reader_stats(s->reader, st);
+}
+
+/*
+ * Readers of the same database may be used by different threads at
+ * the same time.
+ */
+struct dc_reader *
+database_reader(const struct dc_database *db, size_t nchunks)
+{
+	struct dc_reader *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
+	r->s = db->data;
+	TAILQ_INIT(&r->c_lru);
+
+	if (r->s->codec->init != NULL && r->s->codec->init(r) == -1) {
+		free(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (gz_cache(r, nchunks) == -1) {
+		database_reader_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void
+database_reader_free(struct dc_reader *r)
+{
+	size_t i;
+
+	if (r == NULL)
+		return;
+
+	if (r->s->codec->fini != NULL)
+		r->s->codec->fini(r);
+	for (i = 0; i < r->c_size; i++)
+		free(r->c_slots[i].buf);
+	free(r->c_slots);
+	free(r->c_map);
+	free(r);
+}
+
+void
+database_reader_stats(const struct dc_reader *r, struct dc_stats *st)
+{
+	st->chunk_hits = r->c_hits;
+	st->chunk_misses = r->c_misses;
+	st->shared_hits = r->c_shared;
+	st->z_in = r->z_in;
+	st->z_out = r->z_out;
+	st->inflate_ns = r->z_ns;
+}
+
+static int
+gz_copy(void *arg, const char *p, size_t len)
+{
+	char **out = arg;
+
+	memcpy(*out, p, len);
+	*out += len;
+	return 0;
+}
+
+int
+database_read(struct dc_reader *r, const struct dc_index_entry *req,
+    char *out)
+{
+	if (req->def != NULL)
+		memcpy(out, req->def, req->def_len);
+	else if (gz_read(r, req->def_off, req->def_len, gz_copy, &out) == -1)
 		return -1;
 
 	return req->def_len;
 }
 
+/*
+ * Pass the definition to fn piece by piece, as it is inflated, so it
+ * may be of any length.  Stop at the first piece fn returns -1 for.
+ */
+int
+database_stream(struct dc_index_entry *req, struct dc_database *db,
+    database_fn fn, void *arg)
+{
+	const gz_stream *s = db->data;
+
+	return database_read_stream(s->reader, req, fn, arg);
+}
+
+int
+database_read_stream(struct dc_reader *r, const struct dc_index_entry *req,
+    database_fn fn, void *arg)
+{
+	if (req->def != NULL)
+		return fn(arg, req->def, req->def_len) == -1 ? -1 : 0;
+	return gz_read(r, req->def_off, req->def_len, fn, arg);
+}
+
+/*
+ * Return the definition in the mapped file if the database is not
+ * compressed and holds all of it, or NULL.  Definitions added by an
+ * overlay are always mapped.
+ */
+const char *
+database_mapped(const struct dc_database *db, const struct dc_index_entry *e)
+{
+	const gz_stream *s = db->data;
+	size_t len = s->z_buflen - s->z_hlen;
+
+	if (e->def != NULL)
+		return e->def;
+	if (s->codec != PLAIN_CODEC || e->def_off > len ||
+	    e->def_len > len - e->def_off)
+		return NULL;
+	return (const char *)s->z_buf + s->z_hlen + e->def_off;
+}
+
+/*
+ * Share inflated chunks with other processes using the database at
+ * path, in a segment of at most size bytes.  The segment of the first
+ * process is used by all later ones.  On failure the chunks are just
+ * kept private.
+ */
+int
+database_share(struct dc_database *db, int fd, const char *path,
+    size_t size)
+{
+	gz_stream *s = db->data;
+	struct gz_shm *h;
+	struct stat sb, ssb;
+	char name[64];
+	const char *p;
+	u_int64_t hash = 0xcbf29ce484222325ULL;
+	size_t stride, nslots, len;
+	int shm_fd, tries, created;
+
+	if (s->codec == PLAIN_CODEC || s->shm != NULL)
+		return 0;
+	if (fstat(fd, &sb) == -1)
+		return -1;
+
+	stride = (sizeof(struct gz_shm_slot) + s->ra_clen + SHM_ALIGN - 1) &
+	    ~(SHM_ALIGN - 1);
+	nslots = MIN((size - MIN(size, SHM_HDRLEN)) / stride, s->ra_ccount);
+	if (nslots == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * Per user, a segment writable by others could change definitions.
+	 * Keyed by FNV-1a of the path, a rebuilt database with a new inode
+	 * replaces the segment of the old one instead of leaving it behind.
+	 */
+	for (p = path; *p != '\0'; p++)
+		hash = (hash ^ (u_char)*p) * 0x100000001b3ULL;
+	snprintf(name, sizeof(name), "/dict.%u.%016llx", (u_int)getuid(),
+	    (unsigned long long)hash);
+	for (tries = 0; tries < 2; tries++) {
+		created = 0;
+		if ((shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL,
+		    0600)) != -1) {
+			created = 1;
+			len = SHM_HDRLEN + nslots * stride;
+			if (ftruncate(shm_fd, len) == -1) {
+				close(shm_fd);
+				shm_unlink(name);
+				return -1;
+			}
+		} else if (errno != EEXIST ||
+		    (shm_fd = shm_open(name, O_RDWR, 0)) == -1) {
+			return -1;
+		} else {
+			if (fstat(shm_fd, &ssb) == -1) {
+				close(shm_fd);
+				return -1;
+			}
+			len = ssb.st_size;
+			if (len < SHM_HDRLEN) {
+				/* not yet truncated by its creator */
+				close(shm_fd);
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+
+		h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
+		    0);
+		close(shm_fd);
+		if (h == MAP_FAILED)
+			return -1;
+
+		if (created) {
+			h->clen = s->ra_clen;
+			h->dev = sb.st_dev;
+			h->ino = sb.st_ino;
+			h->size = sb.st_size;
+			h->mtime_sec = sb.st_mtim.tv_sec;
+			h->mtime_nsec = sb.st_mtim.tv_nsec;
+			h->nslots = nslots;
+			__atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+			munmap(h, len);
+			errno = EAGAIN;
+			return -1;
+		}
+		if (h->clen == s->ra_clen && h->dev == (u_int64_t)sb.st_dev &&
+		    h->ino == (u_int64_t)sb.st_ino &&
+		    h->size == (u_int64_t)sb.st_size &&
+		    h->mtime_sec == sb.st_mtim.tv_sec &&
+		    h->mtime_nsec == sb.st_mtim.tv_nsec && h->nslots > 0 &&
+		    h->nslots <= (len - SHM_HDRLEN) / stride)
+			break;
+
+		/* the file changed, processes still using it keep the old */
+		munmap(h, len);
+		if (shm_unlink(name) == -1 && errno != ENOENT)
+			return -1;
+	}
+	if (tries == 2) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	s->shm = (u_char *)h;
+	s->shm_len = len;
+	s->shm_nslots = h->nslots;
+	s->shm_stride = stride;
+	return 0;
+}
+
+static void *
+materialize_worker(void *arg)
+{
+	struct gz_materialize *m = arg;
+	const gz_stream *s = m->db->data;
+	struct dc_reader *r;
+	const char *p;
+	size_t chunk;
+
+	if ((r = database_reader(m->db, 1)) == NULL) {
+		__atomic_store_n(&m->error, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	while (!__atomic_load_n(&m->error, __ATOMIC_RELAXED) &&
+	    (chunk = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED)) <
+	    m->nchunks) {
+		/* only the last chunk may be short */
+		if (database_chunk(r, chunk, &p) != (ssize_t)s->ra_clen) {
+			__atomic_store_n(&m->error, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		memcpy(m->out + chunk * s->ra_clen, p, s->ra_clen);
+	}
+	database_reader_free(r);
+	return NULL;
+}
+
+/*
+ * Write the plain text of the database read from fd to path, inflating
+ * its chunks with up to jobs threads.  The chunks are independent, so
+ * each thread takes the next one left.
+ */
+int
+database_materialize(const struct dc_database *db, int fd, const char *path,
+    int jobs)
+{
+	const gz_stream *s = db->data;
+	struct gz_materialize m;
+	struct gz_text h;
+	struct dc_reader *r;
+	struct stat sb;
+	pthread_t *threads = NULL;
+	const char *p;
+	char *tmp = NULL;
+	u_char *map = MAP_FAILED;
+	size_t len = 0;
+	ssize_t last;
+	int i, started = 1, tfd = -1, saved;
+
+	if (fstat(fd, &sb) == -1)
+		return -1;
+	if (s->ra_ccount == 0) {
+		errno = EFTYPE;
+		return -1;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.db = db;
+	m.nchunks = s->ra_ccount - 1;
+
+	if ((r = database_reader(db, 1)) == NULL)
+		return -1;
+	if ((last = database_chunk(r, m.nchunks, &p)) == -1) {
+		database_reader_free(r);
+		errno = EFTYPE;
+		return -1;
+	}
+	len = sizeof(h) + m.nchunks * s->ra_clen + last;
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1) {
+		tmp = NULL;
+		goto fail;
+	}
+	if ((tfd = mkstemp(tmp)) == -1)
+		goto fail;
+	if (fchmod(tfd, 0644) == -1 || ftruncate(tfd, len) == -1)
+		goto fail;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, tfd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	m.out = map + sizeof(h);
+	memcpy(m.out + m.nchunks * s->ra_clen, p, last);
+	database_reader_free(r);
+	r = NULL;
+
+	jobs = MAX(1, MIN((size_t)jobs, m.nchunks));
+	if ((threads = calloc(jobs, sizeof(*threads))) == NULL)
+		goto fail;
+	for (; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, materialize_worker,
+		    &m) != 0)
+			break;
+	materialize_worker(&m);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (m.error) {
+		errno = EIO;
+		goto fail;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TEXT_MAGIC, sizeof(h.magic));
+	h.version = TEXT_VERSION;
+	h.src_dev = sb.st_dev;
+	h.src_ino = sb.st_ino;
+	h.src_size = sb.st_size;
+	h.src_sec = sb.st_mtim.tv_sec;
+	h.src_nsec = sb.st_mtim.tv_nsec;
+	h.len = len - sizeof(h);
+	memcpy(map, &h, sizeof(h));
+
+	if (munmap(map, len) == -1) {
+		map = MAP_FAILED;
+		goto fail;
+	}
+	map = MAP_FAILED;
+	if (close(tfd) == -1) {
+		tfd = -1;
+		goto fail;
+	}
+	tfd = -1;
+	if (rename(tmp, path) == -1)
+		goto fail;
+
+	free(threads);
+	free(tmp);
+	return 0;
+
+ fail:
+	saved = errno;
+	database_reader_free(r);
+	if (map != MAP_FAILED)
+		munmap(map, len);
+	if (tfd != -1)
+		close(tfd);
+	if (tmp != NULL)
+		unlink(tmp);
+	free(threads);
+	free(tmp);
+	errno = saved;
+	return -1;
+}
+
+/*
+ * Read the database from its materialized plain text at path instead,
+ * if that was made from the file of fd as it is now.
+ */
+int
+database_materialized(struct dc_database *db, int fd, const char *path)
+{
+	const struct gz_text *h;
+	struct dc_database ndb;
+	struct stat sb, tsb;
+	gz_stream *s;
+	int tfd;
+
+	if (fstat(fd, &sb) == -1 || (tfd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(tfd, &tsb) == -1 || (size_t)tsb.st_size <= sizeof(*h) ||
+	    (s = calloc(1, sizeof(*s))) == NULL) {
+		close(tfd);
+		return -1;
+	}
+	s->z_buflen = tsb.st_size;
+	s->z_buf = mmap(NULL, s->z_buflen, PROT_READ, MAP_PRIVATE, tfd, 0);
+	close(tfd);
+	if (s->z_buf == MAP_FAILED) {
+		free(s);
+		return -1;
+	}
+
+	h = (const struct gz_text *)s->z_buf;
+	if (memcmp(h->magic, TEXT_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != TEXT_VERSION || h->src_dev != (u_int64_t)sb.st_dev ||
+	    h->src_ino != (u_int64_t)sb.st_ino ||
+	    h->src_size != (u_int64_t)sb.st_size ||
+	    h->src_sec != sb.st_mtim.tv_sec ||
+	    h->src_nsec != sb.st_mtim.tv_nsec ||
+	    h->len != s->z_buflen - sizeof(*h)) {
+		gz_close(s);
+		errno = EFTYPE;
+		return -1;
+	}
+
+	ndb.data = s;
+	s->codec = PLAIN_CODEC;
+	if (plain_table(s, sizeof(*h)) == -1 ||
+	    (s->reader = database_reader(&ndb, DEFAULT_CACHE)) == NULL) {
+		gz_close(s);
+		return -1;
+	}
+
+	database_close(db);
+	db->data = s;
+	db->size = (off_t)s->ra_clen * s->ra_ccount;
+	return 0;
+}
+
+size_t
+database_nchunks(const struct dc_database *db)
+{
+	const gz_stream *s = db->data;
+
+	return s->ra_ccount;
+}
+
+/*
+ * Point p at the decompressed chunk and return its length, or -1.  It
+ * stays valid until the next read from r.
+ */
+ssize_t
+database_chunk(struct dc_reader *r, size_t chunk, const char **p)
+{
+	struct gz_chunk *c;
+
+	if ((c = gz_chunk(r, chunk, r->s->ra_clen)) == NULL)
+		return -1;
+	*p = (const char *)c->buf;
+	return c->len;
+}
+
 static gz_stream *
 gz_ropen(int fd)
 {
+	struct dc_database db;
 	struct stat sb;
 	gz_stream *s;
+	size_t i;
 
 	if ((s = calloc(1, sizeof(gz_stream))) == NULL)
 		return NULL;
 
-	if (inflateInit2(&(s->z_stream), -MAX_WBITS) != Z_OK)
-		goto fail;
-
 	if (fstat(fd, &sb) == -1)
 		goto fail;
 	s->z_buflen = sb.st_size;
@@ -147,11 +802,26 @@ gz_ropen(int fd)
 	if (s->z_buf == MAP_FAILED)
 		goto fail;
 
-	s->z_stream.avail_in = s->z_buflen;
-	s->z_stream.next_in = s->z_buf;
+	/* the format is recognized by its magic numbers */
+	for (i = 0; i < sizeof(gz_codecs) / sizeof(gz_codecs[0]); i++) {
+		s->z_avail = s->z_buflen;
+		s->z_next = s->z_buf;
+		s->z_eof = 0;
+		if (gz_codecs[i].open(s) == 0) {
+			s->codec = &gz_codecs[i];
+			break;
+		}
+		free(s->ra_chunks);
+		free(s->ra_offset);
+		s->ra_chunks = NULL;
+		s->ra_offset = NULL;
+	}
 
-	/* read the .gz header */
-	if (get_header(s) != 0 || (s->o_buf = malloc(65535)) == NULL) {
+	db.data = s;
+	if (s->codec == NULL || s->ra_clen == 0 ||
+	    (s->reader = database_reader(&db, DEFAULT_CACHE)) == NULL) {
+		if (s->codec == NULL)
+			errno = EFTYPE;
 		gz_close(s);
 		return NULL;
 	}
@@ -166,12 +836,12 @@ gz_ropen(int fd)
 static int
 get_byte(gz_stream *s)
 {
-	if (s->z_stream.avail_in == 0) {
+	if (s->z_avail == 0) {
 		s->z_eof = 1;
 		return EOF;
 	}
-	s->z_stream.avail_in--;
-	return *s->z_stream.next_in++;
+	s->z_avail--;
+	return *s->z_next++;
 }
 
 static u_int16_t
@@ -203,9 +873,9 @@ get_header_extra_RA(gz_stream *s, int slen)
 
 	s->ra_clen = clen;
 	s->ra_ccount = ccount;
-	if ((s->ra_chunks = malloc(sizeof(u_int16_t) * ccount)) == NULL)
+	if ((s->ra_chunks = calloc(ccount, sizeof(*s->ra_chunks))) == NULL)
 		return -1;
-	if ((s->ra_offset = malloc(sizeof(u_int64_t) * ccount)) == NULL)
+	if ((s->ra_offset = calloc(ccount, sizeof(*s->ra_offset))) == NULL)
 		return -1;
 
 	for (i = 0; i < ccount; i++) {
@@ -322,80 +992,506 @@ get_header(gz_stream *s)
 	return 0;
 }
 
+/*
+ * Keep up to nchunks inflated chunks, at least one is needed to inflate
+ * into.  Cached chunks are dropped.
+ */
 static int
-gz_read(void *cookie, size_t off, char *out, size_t len)
+gz_cache(struct dc_reader *r, size_t nchunks)
 {
-	gz_stream *s = (gz_stream *)cookie;
-	size_t chunk, z_off, cpylen;
-	int error = Z_OK;
+	const gz_stream *s = r->s;
+	struct gz_chunk *slots;
+	size_t i;
 
-	chunk = off / s->ra_clen;
-	off = off % s->ra_clen;
+	nchunks = MAX(1, MIN(nchunks, s->ra_ccount));
 
- again:
-	if (chunk >= s->ra_ccount)
+	if (r->c_map == NULL &&
+	    (r->c_map = calloc(s->ra_ccount, sizeof(*r->c_map))) == NULL)
 		return -1;
-	z_off = s->z_hlen + s->ra_offset[chunk];
-	if (s->z_buflen < z_off + s->ra_chunks[chunk])
+	if ((slots = calloc(nchunks, sizeof(*slots))) == NULL)
 		return -1;
 
-	s->z_stream.next_in = s->z_buf + z_off;
-	s->z_stream.avail_in = s->ra_chunks[chunk];
-	s->z_stream.next_out = s->o_buf;
-	s->z_stream.avail_out = s->ra_clen;
+	for (i = 0; i < r->c_size; i++) {
+		r->c_map[r->c_slots[i].chunk] = NULL;
+		free(r->c_slots[i].buf);
+	}
+	free(r->c_slots);
+	r->c_slots = slots;
+	r->c_size = nchunks;
+	r->z_resume = NULL;
+
+	TAILQ_INIT(&r->c_lru);
+	for (i = 0; i < nchunks; i++) {
+		if ((slots[i].buf = malloc(s->ra_clen)) == NULL)
+			return -1;
+		TAILQ_INSERT_TAIL(&r->c_lru, &slots[i], lru);
+	}
+
+	return 0;
+}
+
+static u_int64_t
+gz_nsec(void)
+{
+	struct timespec ts;
 
-	while (error == Z_OK && !s->z_eof && s->z_stream.avail_out != 0) {
-		if (s->z_stream.avail_in == 0)
-			break;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-		error = inflate(&(s->z_stream), Z_PARTIAL_FLUSH);
+static int
+gz_open_header(gz_stream *s)
+{
+	return get_header(s);
+}
+
+static int
+gz_init(struct dc_reader *r)
+{
+	if (inflateInit2(&(r->z_stream), -MAX_WBITS) != Z_OK)
+		return -1;
+	return 0;
+}
+
+static void
+gz_fini(struct dc_reader *r)
+{
+	(void)inflateEnd(&r->z_stream);
+}
+
+/*
+ * Inflate until z_need bytes of the chunk are there.  The inflater is
+ * left in the chunk, so the rest can be inflated when it is needed.
+ */
+static ssize_t
+gz_inflate(struct dc_reader *r, size_t chunk, struct gz_chunk *c)
+{
+	const gz_stream *s = r->s;
+	size_t want, avail;
+	int error = Z_OK;
+
+	/* every chunk is flushed, no state is kept between them */
+	if (r->z_resume != c) {
+		inflateReset(&(r->z_stream));
+		r->z_stream.next_in = s->z_buf + s->z_hlen +
+		    s->ra_offset[chunk];
+		r->z_stream.avail_in = s->ra_chunks[chunk];
+	}
+	r->z_resume = NULL;
+	avail = r->z_stream.avail_in;
+
+	want = MIN(s->ra_clen, (r->z_need + INFLATE_STEP - 1) / INFLATE_STEP *
+	    INFLATE_STEP);
+	r->z_stream.next_out = c->buf + c->len;
+	r->z_stream.avail_out = want - c->len;
+
+	while (error == Z_OK && r->z_stream.avail_out != 0) {
+		error = inflate(&(r->z_stream), Z_PARTIAL_FLUSH);
 
 		if (error == Z_DATA_ERROR) {
 			errno = EINVAL;
 			return -1;
 		} else if (error == Z_BUF_ERROR) {
-			errno = EIO;
-			return -1;
-		} else if (error == Z_STREAM_END) {
-			s->z_eof = 1;
-			inflateReset(&(s->z_stream)); // XXX
+			/* no progress, the chunk is complete without input */
+			if (r->z_stream.avail_in != 0) {
+				errno = EIO;
+				return -1;
+			}
 			break;
 		}
 	}
 
-	cpylen = MIN(len, s->ra_clen - off);
-	memcpy(out, s->o_buf + off, cpylen);
-	len -= cpylen;
-	out += cpylen;
-	chunk++;
-	off = 0;
-	if (len > 0)
-		goto again;
+	c->len = want - r->z_stream.avail_out;
+	c->partial = error == Z_OK && c->len < s->ra_clen;
+	if (c->partial)
+		r->z_resume = c;
+	return avail - r->z_stream.avail_in;
+}
 
+static u_int32_t
+get_le32(const u_char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u_int32_t)p[3] << 24;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+/*
+ * Read the seek table at the end of the file.  Its frames all hold
+ * ra_clen bytes, but the last one.  Checksums are ignored.
+ */
+static int
+seek_table(gz_stream *s, u_int32_t frame_magic)
+{
+	const u_char *foot, *t, *e;
+	size_t i, n, esize;
+	u_int64_t off = 0;
+	u_int32_t dlen;
+
+	if (s->z_buflen < 8 + SEEK_FOOTER || get_le32(s->z_buf) != frame_magic)
+		return -1;
+	foot = s->z_buf + s->z_buflen - SEEK_FOOTER;
+	if (get_le32(foot + 5) != SEEK_MAGIC || (foot[4] & 0x7c) != 0)
+		return -1;
+	n = get_le32(foot);
+	esize = (foot[4] & 0x80) != 0 ? 12 : 8;
+	if (n == 0 || n > (s->z_buflen - 8 - SEEK_FOOTER) / esize)
+		return -1;
+	t = foot - n * esize;
+	if (get_le32(t - 8) != SEEK_SKIPPABLE ||
+	    get_le32(t - 4) != n * esize + SEEK_FOOTER)
+		return -1;
+
+	s->ra_clen = get_le32(t + 4);
+	if (s->ra_clen == 0 || s->ra_clen > SEEK_CHUNK_MAX)
+		return -1;
+	if ((s->ra_chunks = calloc(n, sizeof(*s->ra_chunks))) == NULL ||
+	    (s->ra_offset = calloc(n, sizeof(*s->ra_offset))) == NULL)
+		return -1;
+	for (i = 0, e = t; i < n; i++, e += esize) {
+		dlen = get_le32(e + 4);
+		if (dlen > s->ra_clen || (dlen < s->ra_clen && i != n - 1))
+			return -1;
+		s->ra_chunks[i] = get_le32(e);
+		s->ra_offset[i] = off;
+		off += s->ra_chunks[i];
+	}
+	if (off > (size_t)(t - 8 - s->z_buf))
+		return -1;
+
+	s->ra_ccount = n;
+	s->z_hlen = 0;
 	return 0;
 }
+#endif
 
+#ifdef HAVE_ZSTD
 static int
-gz_close(void *cookie)
+zstd_open(gz_stream *s)
 {
-	gz_stream *s = (gz_stream *)cookie;
-	int err = 0;
+	return seek_table(s, ZSTD_FRAME);
+}
 
-	if (s == NULL)
+static int
+zstd_init(struct dc_reader *r)
+{
+	if ((r->z_ctx = ZSTD_createDCtx()) == NULL)
 		return -1;
+	return 0;
+}
 
-	if (!err && s->z_stream.state != NULL) {
-		err = inflateEnd(&s->z_stream);
+static void
+zstd_fini(struct dc_reader *r)
+{
+	ZSTD_freeDCtx(r->z_ctx);
+}
+
+static ssize_t
+zstd_chunk(struct dc_reader *r, size_t chunk, struct gz_chunk *c)
+{
+	const gz_stream *s = r->s;
+	size_t n;
+
+	n = ZSTD_decompressDCtx(r->z_ctx, c->buf, s->ra_clen,
+	    s->z_buf + s->ra_offset[chunk], s->ra_chunks[chunk]);
+	if (ZSTD_isError(n)) {
+		errno = EINVAL;
+		return -1;
 	}
+	c->len = n;
+	return s->ra_chunks[chunk];
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int
+lz4_open(gz_stream *s)
+{
+	return seek_table(s, LZ4_FRAME);
+}
+
+static int
+lz4_init(struct dc_reader *r)
+{
+	LZ4F_dctx *dctx;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return -1;
+	r->z_ctx = dctx;
+	return 0;
+}
 
-	if (!err)
-		err = munmap(s->z_buf, s->z_buflen);
-	else
-		(void)munmap(s->z_buf, s->z_buflen);
+static void
+lz4_fini(struct dc_reader *r)
+{
+	(void)LZ4F_freeDecompressionContext(r->z_ctx);
+}
+
+static ssize_t
+lz4_chunk(struct dc_reader *r, size_t chunk, struct gz_chunk *c)
+{
+	const gz_stream *s = r->s;
+	const u_char *in = s->z_buf + s->ra_offset[chunk];
+	size_t ret, in_len, out_len, left = s->ra_chunks[chunk];
+
+	LZ4F_resetDecompressionContext(r->z_ctx);
+	c->len = 0;
+	do {
+		in_len = left;
+		out_len = s->ra_clen - c->len;
+		ret = LZ4F_decompress(r->z_ctx, c->buf + c->len, &out_len,
+		    in, &in_len, NULL);
+		if (LZ4F_isError(ret)) {
+			errno = EINVAL;
+			return -1;
+		}
+		in += in_len;
+		left -= in_len;
+		c->len += out_len;
+	} while (ret != 0 && left > 0 && c->len < s->ra_clen);
+
+	if (ret != 0) {
+		errno = EIO;
+		return -1;
+	}
+	return s->ra_chunks[chunk] - left;
+}
+#endif
+
+/*
+ * Anything without the magic number of a compressed format is taken as
+ * plain text, split into chunks so it can be read like the others.
+ */
+static int
+plain_open(gz_stream *s)
+{
+	u_int32_t magic = 0;
+
+	if (s->z_buflen >= 4)
+		magic = get_le32(s->z_buf);
+	if (s->z_buflen == 0 || (s->z_buflen >= 2 &&
+	    memcmp(s->z_buf, gz_magic, sizeof(gz_magic)) == 0) ||
+	    magic == ZSTD_FRAME || magic == LZ4_FRAME) {
+		errno = EFTYPE;
+		return -1;
+	}
+
+	return plain_table(s, 0);
+}
+
+/*
+ * The text starts after hlen bytes of the file.
+ */
+static int
+plain_table(gz_stream *s, size_t hlen)
+{
+	size_t i, len = s->z_buflen - hlen;
+
+	s->ra_clen = PLAIN_CHUNK;
+	s->ra_ccount = (len + PLAIN_CHUNK - 1) / PLAIN_CHUNK;
+	if ((s->ra_chunks = calloc(s->ra_ccount,
+	    sizeof(*s->ra_chunks))) == NULL ||
+	    (s->ra_offset = calloc(s->ra_ccount,
+	    sizeof(*s->ra_offset))) == NULL)
+		return -1;
+	for (i = 0; i < s->ra_ccount; i++) {
+		s->ra_offset[i] = (u_int64_t)i * PLAIN_CHUNK;
+		s->ra_chunks[i] = MIN(PLAIN_CHUNK, len - i * PLAIN_CHUNK);
+	}
+	s->z_hlen = hlen;
+	return 0;
+}
+
+static ssize_t
+plain_chunk(struct dc_reader *r, size_t chunk, struct gz_chunk *c)
+{
+	const gz_stream *s = r->s;
+
+	c->len = s->ra_chunks[chunk];
+	memcpy(c->buf, s->z_buf + s->z_hlen + s->ra_offset[chunk], c->len);
+	return c->len;
+}
+
+/*
+ * Decompress a chunk with the codec of the stream.
+ */
+static int
+gz_decode(struct dc_reader *r, size_t chunk, struct gz_chunk *c, size_t need)
+{
+	const gz_stream *s = r->s;
+	size_t z_off, len;
+	ssize_t in;
+	u_int64_t start = 0;
+
+	if (chunk >= s->ra_ccount)
+		return -1;
+	z_off = s->z_hlen + s->ra_offset[chunk];
+	if (s->z_buflen < z_off + s->ra_chunks[chunk])
+		return -1;
+
+	DC_PROBE2(inflate, chunk, s->ra_chunks[chunk]);
+	if (dc_stats_enabled)
+		start = gz_nsec();
+
+	if (r->z_resume != c)
+		c->len = 0;
+	len = c->len;
+	c->partial = 0;
+	r->z_need = need;
+	if ((in = s->codec->chunk(r, chunk, c)) == -1)
+		return -1;
+
+	r->z_in += in;
+	r->z_out += c->len - len;
+	if (dc_stats_enabled)
+		r->z_ns += gz_nsec() - start;
+	return 0;
+}
+
+static struct gz_shm_slot *
+shm_slot(const gz_stream *s, size_t chunk)
+{
+	return (struct gz_shm_slot *)(s->shm + SHM_HDRLEN +
+	    (chunk % s->shm_nslots) * s->shm_stride);
+}
+
+static int
+shm_get(const gz_stream *s, size_t chunk, struct gz_chunk *c)
+{
+	struct gz_shm_slot *sl = shm_slot(s, chunk);
+	u_int32_t seq, len;
+
+	seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) != 0 ||
+	    __atomic_load_n(&sl->chunk, __ATOMIC_RELAXED) != chunk + 1)
+		return -1;
+	len = __atomic_load_n(&sl->len, __ATOMIC_RELAXED);
+	if (len > s->ra_clen)
+		return -1;
+	memcpy(c->buf, sl + 1, len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq)
+		return -1;
+	c->len = len;
+	return 0;
+}
+
+/*
+ * A slot being written by someone else is left alone.
+ */
+static void
+shm_put(const gz_stream *s, size_t chunk, const struct gz_chunk *c)
+{
+	struct gz_shm_slot *sl = shm_slot(s, chunk);
+	u_int32_t seq;
+
+	seq = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) != 0 || !__atomic_compare_exchange_n(&sl->seq, &seq,
+	    seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&sl->chunk, chunk + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sl->len, c->len, __ATOMIC_RELAXED);
+	memcpy(sl + 1, c->buf, c->len);
+	__atomic_store_n(&sl->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the slot holding the first need bytes of the inflated chunk,
+ * the least recently used slot is reused on a miss.  Misses are looked
+ * up in shared memory before inflating them.  A chunk inflated only in
+ * part is continued where it stopped.
+ */
+static struct gz_chunk *
+gz_chunk(struct dc_reader *r, size_t chunk, size_t need)
+{
+	struct gz_chunk *c;
+
+	if (chunk >= r->s->ra_ccount)
+		return NULL;
+
+	if ((c = r->c_map[chunk]) != NULL &&
+	    (!c->partial || c->len >= need)) {
+		r->c_hits++;
+	} else {
+		r->c_misses++;
+		if (c == NULL) {
+			c = TAILQ_LAST(&r->c_lru, gz_chunk_lru);
+			if (r->c_map[c->chunk] == c)
+				r->c_map[c->chunk] = NULL;
+			if (r->z_resume == c)
+				r->z_resume = NULL;
+			c->len = 0;
+			c->partial = 0;
+		}
+		if (r->s->shm != NULL && shm_get(r->s, chunk, c) == 0) {
+			r->c_shared++;
+			if (r->z_resume == c)
+				r->z_resume = NULL;
+			c->partial = 0;
+		} else if (gz_decode(r, chunk, c, need) == -1) {
+			r->c_map[chunk] = NULL;
+			return NULL;
+		} else if (r->s->shm != NULL && !c->partial)
+			shm_put(r->s, chunk, c);
+		c->chunk = chunk;
+		r->c_map[chunk] = c;
+	}
+
+	if (c != TAILQ_FIRST(&r->c_lru)) {
+		TAILQ_REMOVE(&r->c_lru, c, lru);
+		TAILQ_INSERT_HEAD(&r->c_lru, c, lru);
+	}
+
+	return c;
+}
+
+/*
+ * Pass the inflated bytes to fn chunk by chunk, inflating no further
+ * than the end of the definition.
+ */
+static int
+gz_read(struct dc_reader *r, size_t off, size_t len, database_fn fn,
+    void *arg)
+{
+	struct gz_chunk *c;
+	size_t chunk, n;
+
+	chunk = off / r->s->ra_clen;
+	off = off % r->s->ra_clen;
+
+	while (len > 0) {
+		if ((c = gz_chunk(r, chunk, MIN(r->s->ra_clen, off + len))) ==
+		    NULL)
+			return -1;
+		if (off >= c->len)
+			return -1;
+
+		n = MIN(len, c->len - off);
+		if (fn(arg, (const char *)c->buf + off, n) == -1)
+			return -1;
+		len -= n;
+		chunk++;
+		off = 0;
+	}
+
+	return 0;
+}
+
+static int
+gz_close(gz_stream *s)
+{
+	int err;
+
+	if (s == NULL)
+		return -1;
 
+	database_reader_free(s->reader);
+	if (s->shm != NULL)
+		munmap(s->shm, s->shm_len);
+	err = munmap(s->z_buf, s->z_buflen);
 	free(s->ra_chunks);
 	free(s->ra_offset);
-	free(s->o_buf);
 	free(s);
 
 	return err;
@@ -16,6 +16,29 @@
 
 struct dc_database;
 struct dc_index_entry;
+struct dc_reader;
+struct dc_stats;
+
+typedef int (*database_fn)(void *, const char *, size_t);
+
+extern const char *const database_suffixes[];
 
 int database_open(int, struct dc_database *);
-int database_lookup(struct dc_index_entry *, struct dc_database *, char *);
+void database_close(struct dc_database *);
+int database_cache(struct dc_database *, size_t);
+void database_stats(const struct dc_database *, struct dc_stats *);
+struct dc_reader *database_reader(const struct dc_database *, size_t);
+void database_reader_free(struct dc_reader *);
+void database_reader_stats(const struct dc_reader *, struct dc_stats *);
+int database_read(struct dc_reader *, const struct dc_index_entry *, char *);
+int database_stream(struct dc_index_entry *, struct dc_database *,
+    database_fn, void *);
+int database_read_stream(struct dc_reader *, const struct dc_index_entry *,
+    database_fn, void *);
+const char *database_mapped(const struct dc_database *,
+    const struct dc_index_entry *);
+int database_share(struct dc_database *, int, const char *, size_t);
+int database_materialize(const struct dc_database *, int, const char *, int);
+int database_materialized(struct dc_database *, int, const char *);
+size_t database_nchunks(const struct dc_database *);
+ssize_t database_chunk(struct dc_reader *, size_t, const char **);
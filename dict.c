@@ -16,112 +16,910 @@
 
 #include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#include <ctype.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "database.h"
 #include "dict.h"
 #include "index.h"
+#include "server.h"
 
-#define MAX_RESULTS	1000
 #define _FREEDICT_PATH	"/usr/local/freedict"
+#define BATCH_BUFSIZ	(256 * 1024)	/* stdout buffer */
+#define BATCH_BYTES	(1024 * 1024)
+#define BATCH_WORDS	65536
+#define JOBS_MAX	256
+#define OUT_IOV		64	/* mapped definitions per writev(2) */
+#define SHM_MAX		4096	/* megabytes of shared chunks per database */
+
+struct query {
+	struct dc_query	 q;
+	size_t		 i;
+};
+
+struct lookup {
+	const struct dc_strategy *strat;
+	char		**words;
+	struct dc_query	 *qs;		/* in the given order */
+	struct dc_query	 *sorted;	/* ascending or NULL */
+	size_t		 *order;	/* position in qs of every sorted one */
+	size_t		  n;
+};
+
+struct pool {
+	struct dc_database	*dbs;
+	size_t			 ndbs;
+	const struct lookup	*l;
+	char			**out;		/* results of every database */
+	size_t			*outlen;
+	size_t			 next;		/* database to search next */
+	pthread_mutex_t		 mtx;
+};
+
+static int dflag, mflag, Mflag, automat, jobs = 1;
+static size_t dist = 1, shm_size;
+static size_t limit, offset;	/* results of each word, 0 for all */
+static char *text_dir;		/* materialized databases */
+static uint64_t open_ns, validate_ns, lookup_ns, out_bytes;
+static struct iovec out_iov[2 * OUT_IOV];
+static int out_niov;
 
 static __dead void
 usage(void)
 {
-	fputs("usage: dict -D dictionary [-Vdem] word [...]\n", stderr);
+	fputs("usage: dict -D dictionary [-Vbdemrs] [-c chunks] [-f distance] "
+	    "[-j jobs]\n"
+	    "            [-l limit] [-o offset] [-t strategy] [word ...]\n"
+	    "       dict -D dictionary -M [-V] [-j jobs]\n"
+	    "       dict -S address [-V] [-c chunks] [-j jobs]\n", stderr);
 	exit(1);
 }
 
-static void
-match(struct dc_index_list *l)
+static uint64_t
+nsec(void)
 {
-	struct dc_index_entry *e;
-	const char *prev_match;
-	int prev_len = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Materialized databases are kept in $XDG_CACHE_HOME/dict, or else in
+ * ~/.cache/dict.  Return NULL if neither is set.
+ */
+static char *
+text_cache(void)
+{
+	const char *env;
+	char *dir;
+
+	if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env == '/') {
+		if (asprintf(&dir, "%s/dict", env) == -1)
+			err(1, NULL);
+	} else if ((env = getenv("HOME")) != NULL && *env == '/') {
+		if (asprintf(&dir, "%s/.cache/dict", env) == -1)
+			err(1, NULL);
+	} else
+		return NULL;
+	return dir;
+}
+
+/*
+ * Like mkdir -p of the cache directory.  It runs before unveil(2),
+ * which would hide the ancestors.  Existing directories may refuse
+ * mkdir(2) with another error than EEXIST, like EROFS.
+ */
+static int
+text_mkdir(const char *dir)
+{
+	struct stat sb;
+	char *path, *p;
+	int ret = 0;
 
-	SLIST_FOREACH(e, l, entries) {
-		if (e->match == NULL)
+	if ((path = strdup(dir)) == NULL)
+		return -1;
+	for (p = path + 1; ret == 0; p++) {
+		if ((p = strchr(p, '/')) != NULL)
+			*p = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST &&
+		    (stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode)))
+			ret = -1;
+		if (p == NULL)
 			break;
+		*p = '/';
+	}
+	free(path);
+	return ret;
+}
+
+/*
+ * Write the plain text of a compressed database to path and read it
+ * from there from now on.
+ */
+static int
+materialize(struct dc_database *db, int fd, const char *path)
+{
+	if (database_materialize(db, fd, path, jobs) == -1)
+		return -1;
+	return database_materialized(db, fd, path);
+}
+
+/*
+ * Print the distinct headwords, return the number of bytes written.
+ */
+static size_t
+match(FILE *out, struct dc_index_iter *it)
+{
+	struct dc_index_entry e;
+	const char *prev_match = NULL;
+	size_t n = 0;
+	int prev_len = 0;
+
+	while (index_iter_next(it, &e) != NULL) {
+		if (prev_len > 0 && prev_len == e.match_len
+		    && strncmp(prev_match, e.match, prev_len) == 0)
+			continue;
+		prev_len = e.match_len;
+		prev_match = e.match;
+
+		n += fprintf(out, "- %.*s\n", e.match_len, e.match);
+	}
+	return n;
+}
+
+/*
+ * Write the definitions gathered by out_mapped() to stdout.
+ */
+static void
+out_flush(void)
+{
+	struct iovec *iov = out_iov;
+	ssize_t n;
+	int niov = out_niov;
+
+	out_niov = 0;
+	while (niov > 0) {
+		if ((n = writev(STDOUT_FILENO, iov, niov)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "stdout");
+		}
+		for (; niov > 0 && (size_t)n >= iov->iov_len; iov++, niov--)
+			n -= iov->iov_len;
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Definitions in the mapping of an uncompressed database are written
+ * to stdout without copying them, anything buffered by stdio first.
+ */
+static size_t
+out_mapped(FILE *out, const char *def, size_t len)
+{
+	static char dash[] = "- ";
+
+	if (out != stdout) {
+		fputs(dash, out);
+		fwrite(def, 1, len, out);
+		return len + 2;
+	}
+
+	if (out_niov == 0)
+		fflush(stdout);
+	out_iov[out_niov].iov_base = dash;
+	out_iov[out_niov++].iov_len = 2;
+	out_iov[out_niov].iov_base = (char *)def;
+	out_iov[out_niov++].iov_len = len;
+	if (out_niov == sizeof(out_iov) / sizeof(out_iov[0]))
+		out_flush();
+	return len + 2;
+}
+
+static int
+out_piece(void *arg, const char *p, size_t len)
+{
+	FILE *out = arg;
+
+	if (fwrite(p, 1, len, out) != len)
+		return -1;
+	return 0;
+}
+
+/*
+ * Definitions are written as they are inflated, whatever their length.
+ */
+static size_t
+define(FILE *out, struct dc_database *db, struct dc_index_iter *it)
+{
+	struct dc_index_entry e;
+	const char *def;
+	size_t n = 0;
+
+	while (index_iter_next(it, &e) != NULL) {
+		if ((def = database_mapped(db, &e)) != NULL) {
+			n += out_mapped(out, def, e.def_len);
+			continue;
+		}
+		/* definitions of an overlay are mapped, the others not */
+		if (out == stdout && out_niov > 0)
+			out_flush();
+		fputs("- ", out);
+		if (database_stream(&e, db, out_piece, out) == -1)
+			errx(1, "dictionary lookup failed for: %.*s\n",
+			    e.match_len, e.match);
+		n += e.def_len + 2;
+	}
+	return n;
+}
+
+static int
+iter_begin(struct dc_index_iter *it, struct dc_database *db,
+    const struct lookup *l, const off_t *pos, size_t i)
+{
+	int ret;
+
+	if (pos != NULL)
+		ret = index_iter_at(it, l->strat, &l->qs[i], pos[i],
+		    &db->index);
+	else
+		ret = index_iter_begin(it, l->strat, &l->qs[i], &db->index);
+	if (ret == 0 && (limit > 0 || offset > 0))
+		index_iter_page(it, offset, limit);
+	return ret;
+}
+
+static int
+query_cmp(const void *a, const void *b)
+{
+	const struct query *qa = a, *qb = b;
+	int c;
+
+	/* keys like Soundex codes are shortened in place, not terminated */
+	c = memcmp(qa->q.word, qb->q.word, MIN(qa->q.len, qb->q.len));
+	if (c != 0)
+		return c;
+	return (qa->q.len > qb->q.len) - (qa->q.len < qb->q.len);
+}
+
+/*
+ * Turn n words into queries once for all dictionaries.  Several words
+ * are also sorted, so they can be located in a single walk over each
+ * index.
+ */
+static void
+lookup_init(struct lookup *l, const struct dc_strategy *strat, char **words,
+    size_t n)
+{
+	struct query *q;
+	size_t i;
+
+	memset(l, 0, sizeof(*l));
+	l->strat = strat;
+	l->words = words;
+	l->n = n;
+	if ((l->qs = calloc(n, sizeof(*l->qs))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++) {
+		index_query(&l->qs[i], strat, words[i]);
+		l->qs[i].dist = dist;
+		l->qs[i].jobs = jobs;
+	}
+
+	if (n > 1 && strat->compar != NULL) {
+		if ((q = calloc(n, sizeof(*q))) == NULL ||
+		    (l->sorted = calloc(n, sizeof(*l->sorted))) == NULL ||
+		    (l->order = calloc(n, sizeof(*l->order))) == NULL)
+			err(1, NULL);
+		for (i = 0; i < n; i++) {
+			q[i].q = l->qs[i];
+			q[i].i = i;
+		}
+		qsort(q, n, sizeof(*q), query_cmp);
+		for (i = 0; i < n; i++) {
+			l->sorted[i] = q[i].q;
+			l->order[i] = q[i].i;
+		}
+		free(q);
+	}
+}
+
+static void
+lookup_free(struct lookup *l)
+{
+	free(l->qs);
+	free(l->sorted);
+	free(l->order);
+}
+
+/*
+ * Look up the queries in one dictionary, the results are written in
+ * the given order.  Return the number of bytes written.
+ */
+static size_t
+lookup_db(struct dc_database *db, const struct lookup *l, FILE *out)
+{
+	struct dc_index_iter it;
+	off_t *spos = NULL, *pos = NULL;
+	size_t i, n = 0;
 
-		if (prev_len > 0 && prev_len == e->match_len
-		    && strncmp(prev_match, e->match, prev_len) == 0) {
-			e->match = NULL;
+	if (l->sorted != NULL) {
+		if ((spos = calloc(l->n, sizeof(*spos))) == NULL ||
+		    (pos = calloc(l->n, sizeof(*pos))) == NULL)
+			err(1, NULL);
+		index_locate(l->strat, l->sorted, l->n, &db->index, spos);
+		for (i = 0; i < l->n; i++)
+			pos[l->order[i]] = spos[i];
+	}
+
+	for (i = 0; i < l->n; i++) {
+		if (iter_begin(&it, db, l, pos, i) == -1) {
+			warnx("invalid pattern: %s", l->words[i]);
+			index_iter_end(&it);
 			continue;
 		}
-		prev_len = e->match_len;
-		prev_match = e->match;
+		if (mflag) {
+			if (out == stdout)
+				out_flush();
+			n += match(out, &it);
+			if (dflag) {
+				index_iter_end(&it);
+				iter_begin(&it, db, l, pos, i);
+			}
+		}
+		if (dflag)
+			n += define(out, db, &it);
+		index_iter_end(&it);
+	}
+	if (out == stdout)
+		out_flush();
+
+	free(spos);
+	free(pos);
+	return n;
+}
+
+/*
+ * Workers take the next dictionary until none is left.  Every database
+ * is used by a single thread, so its inflater and chunk cache are never
+ * shared.
+ */
+static void *
+lookup_worker(void *arg)
+{
+	struct pool *pl = arg;
+	FILE *fp;
+	size_t i;
 
-		printf("- %.*s\n", e->match_len, e->match);
+	for (;;) {
+		pthread_mutex_lock(&pl->mtx);
+		i = pl->next++;
+		pthread_mutex_unlock(&pl->mtx);
+		if (i >= pl->ndbs)
+			break;
 
-		e->match = NULL;
+		if ((fp = open_memstream(&pl->out[i], &pl->outlen[i])) == NULL)
+			err(1, NULL);
+		lookup_db(&pl->dbs[i], pl->l, fp);
+		if (fclose(fp) == EOF)
+			err(1, NULL);
 	}
+	return NULL;
 }
 
+/*
+ * Look up n words in every dictionary.  With several dictionaries, each
+ * is searched by a thread of a pool and the results are printed per
+ * dictionary in the order of dbs, below a line with its name.
+ */
 static void
-define(struct dc_database *db, struct dc_index_list *l)
+lookup(struct dc_database *dbs, size_t ndbs, const struct dc_strategy *strat,
+    char **words, size_t n)
 {
-	char buf[LOOKUP_MAX];
-	struct dc_index_entry *e;
-	int r;
+	struct lookup l;
+	struct pool pl;
+	pthread_t *threads;
+	size_t i, nthreads, started;
+
+	lookup_init(&l, strat, words, n);
+	if (ndbs == 1) {
+		out_bytes += lookup_db(&dbs[0], &l, stdout);
+		lookup_free(&l);
+		return;
+	}
 
-	SLIST_FOREACH(e, l, entries) {
-		if (e->match == NULL)
+	memset(&pl, 0, sizeof(pl));
+	pl.dbs = dbs;
+	pl.ndbs = ndbs;
+	pl.l = &l;
+	nthreads = MIN((size_t)jobs, ndbs);
+	if ((pl.out = calloc(ndbs, sizeof(*pl.out))) == NULL ||
+	    (pl.outlen = calloc(ndbs, sizeof(*pl.outlen))) == NULL ||
+	    (threads = calloc(nthreads, sizeof(*threads))) == NULL)
+		err(1, NULL);
+	if (pthread_mutex_init(&pl.mtx, NULL) != 0)
+		errx(1, "pthread_mutex_init");
+
+	for (started = 1; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, lookup_worker,
+		    &pl) != 0)
 			break;
-		if (e->def_len > LOOKUP_MAX)
-			errx(1, "definition is too large.");
-		if ((r = database_lookup(e, db, buf)) == -1) {
-			errx(1, "dictionary lookup failed for: %.*s\n",
-			    e->match_len, e->match);
+	lookup_worker(&pl);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < ndbs; i++) {
+		if (pl.outlen[i] > 0) {
+			out_bytes += printf("%s:\n", dbs[i].name);
+			out_bytes += fwrite(pl.out[i], 1, pl.outlen[i], stdout);
+		}
+		free(pl.out[i]);
+	}
+
+	pthread_mutex_destroy(&pl.mtx);
+	free(pl.out);
+	free(pl.outlen);
+	free(threads);
+	lookup_free(&l);
+}
+
+/*
+ * Look up every newline or NUL terminated word read from stdin, in
+ * blocks of up to BATCH_WORDS words.
+ */
+static void
+batch(struct dc_database *dbs, size_t ndbs, const struct dc_strategy *strat)
+{
+	char *buf, **words;
+	size_t len = 0, start = 0, n = 0;
+	int c, skip = 0;
+
+	if ((buf = malloc(BATCH_BYTES)) == NULL ||
+	    (words = calloc(BATCH_WORDS, sizeof(*words))) == NULL)
+		err(1, NULL);
+
+	/* only this thread reads stdin, so it is not locked per byte */
+	for (;;) {
+		c = getchar_unlocked();
+		if (c != EOF && c != '\n' && c != '\0') {
+			if (len - start < WORD_MAX) {
+				buf[len++] = c;
+			} else if (!skip) {
+				warnx("word too long: %.*s...", 32, buf + start);
+				skip = 1;
+			}
+			continue;
+		}
+
+		if (skip || len == start) {
+			len = start;
 		} else {
-			printf("- %.*s", r, buf);
+			buf[len++] = '\0';
+			words[n++] = buf + start;
+			start = len;
 		}
+		skip = 0;
 
-		e->match = NULL;
+		if (n > 0 && (c == EOF || n == BATCH_WORDS ||
+		    len + WORD_MAX + 1 > BATCH_BYTES)) {
+			lookup(dbs, ndbs, strat, words, n);
+			n = len = start = 0;
+		}
+		if (c == EOF)
+			break;
 	}
+	if (ferror(stdin))
+		err(1, "stdin");
+
+	free(buf);
+	free(words);
+}
+
+/*
+ * Open the index and database of the named dictionary below dictpath.
+ */
+int
+dict_open(const char *dictpath, const char *name, struct dc_database *db)
+{
+	char *db_path = NULL, *idx_path = NULL, *text_path = NULL;
+	uint64_t start;
+	size_t i;
+	int db_fd = -1, idx_fd = -1;
+
+	start = nsec();
+	memset(db, 0, sizeof(*db));
+	if ((db->name = strdup(name)) == NULL ||
+	    asprintf(&idx_path, "%s/%s/%s.index", dictpath, name, name) == -1) {
+		warn(NULL);
+		free(db->name);
+		return -1;
+	}
+	db->index.path = idx_path;
+
+	/* the first database that exists, dictzip is the last resort */
+	for (i = 0; database_suffixes[i] != NULL; i++) {
+		free(db_path);
+		if (asprintf(&db_path, "%s/%s/%s%s", dictpath, name, name,
+		    database_suffixes[i]) == -1) {
+			db_path = NULL;
+			warn(NULL);
+			goto fail;
+		}
+		if ((db_fd = open(db_path, O_RDONLY)) != -1 || errno != ENOENT)
+			break;
+	}
+	if (db_fd == -1) {
+		warn("cannot open dictionary '%s'", db_path);
+		goto fail;
+	}
+	if ((idx_fd = open(idx_path, O_RDONLY)) == -1) {
+		warn("cannot open index '%s'", idx_path);
+		goto fail;
+	}
+
+	/* compressed databases may have been materialized as plain text */
+	if (text_dir != NULL && strcmp(database_suffixes[i], ".dict") != 0 &&
+	    asprintf(&text_path, "%s/%s.dict", text_dir, name) == -1) {
+		text_path = NULL;
+		warn(NULL);
+		goto fail;
+	}
+	if (text_path != NULL && database_materialized(db, db_fd,
+	    text_path) == 0) {
+		free(text_path);
+		text_path = NULL;
+	} else if (database_open(db_fd, db) == -1) {
+		warnx("cannot open dictionary '%s'", db_path);
+		goto fail;
+	}
+
+	if (text_path != NULL && (Mflag || automat)) {
+		if (materialize(db, db_fd, text_path) == -1) {
+			warn("cannot materialize '%s'", text_path);
+			if (Mflag)
+				goto fail;
+		}
+	}
+	free(text_path);
+	text_path = NULL;
+
+	/* without shared memory every process inflates on its own */
+	if (shm_size > 0)
+		(void)database_share(db, db_fd, db_path, shm_size);
+
+	if (index_open(idx_fd, &db->index) == -1) {
+		warn("cannot open index '%s'", idx_path);
+		goto fail;
+	}
+
+	/*
+	 * A current line table, written by dictidx -s, saves both the
+	 * validation and the text search.
+	 */
+	(void)index_table_open(&db->index);
+	/* optional, written by dictidx -F */
+	(void)index_bloom_open(&db->index);
+	if (index_delta_open(&db->index) == -1) {
+		warn("cannot open overlay of '%s'", idx_path);
+		goto fail;
+	}
+
+	open_ns += nsec() - start;
+	close(db_fd);
+	close(idx_fd);
+	free(db_path);
+	return 0;
+
+ fail:
+	if (db_fd != -1)
+		close(db_fd);
+	if (idx_fd != -1)
+		close(idx_fd);
+	free(db_path);
+	free(text_path);
+	dict_close(db);
+	return -1;
+}
+
+void
+dict_close(struct dc_database *db)
+{
+	index_close(&db->index);
+	free((char *)db->index.path);
+	database_close(db);
+	free(db->name);
+	memset(db, 0, sizeof(*db));
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Open the dictionaries below dictpath that have an index and a name
+ * matching pattern, or all if pattern is NULL.  They are appended to
+ * the n dictionaries in *dbsp in the order of their names, unless they
+ * are open already.
+ */
+static size_t
+dict_open_all(const char *dictpath, const char *pattern,
+    struct dc_database **dbsp, size_t n)
+{
+	struct dc_database *dbs = *dbsp, *ndbs;
+	struct dirent *dp;
+	struct stat sb;
+	char *path, **names = NULL, **nnames;
+	size_t i, j, nnames_len = 0;
+	DIR *dirp;
+
+	if ((dirp = opendir(dictpath)) == NULL)
+		err(1, "%s", dictpath);
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		if (pattern != NULL && fnmatch(pattern, dp->d_name, 0) != 0)
+			continue;
+		if (asprintf(&path, "%s/%s/%s.index", dictpath, dp->d_name,
+		    dp->d_name) == -1)
+			err(1, NULL);
+		if (stat(path, &sb) == -1) {
+			free(path);
+			continue;
+		}
+		free(path);
+
+		if ((nnames = reallocarray(names, nnames_len + 1,
+		    sizeof(*names))) == NULL)
+			err(1, NULL);
+		names = nnames;
+		if ((names[nnames_len++] = strdup(dp->d_name)) == NULL)
+			err(1, NULL);
+	}
+	closedir(dirp);
+	if (pattern != NULL && nnames_len == 0)
+		errx(1, "no dictionaries match '%s'", pattern);
+
+	qsort(names, nnames_len, sizeof(*names), name_cmp);
+	for (i = 0; i < nnames_len; i++) {
+		for (j = 0; j < n; j++)
+			if (strcmp(dbs[j].name, names[i]) == 0)
+				break;
+		if (j < n)
+			continue;
+		if ((ndbs = reallocarray(dbs, n + 1, sizeof(*dbs))) == NULL)
+			err(1, NULL);
+		dbs = ndbs;
+		if (dict_open(dictpath, names[i], &dbs[n]) == 0)
+			n++;
+	}
+	for (i = 0; i < nnames_len; i++)
+		free(names[i]);
+	free(names);
+
+	*dbsp = dbs;
+	return n;
+}
+
+/*
+ * Open the comma separated list of dictionaries given to -D, items may
+ * be shell patterns.
+ */
+static size_t
+dict_open_list(const char *dictpath, const char *list,
+    struct dc_database **dbsp)
+{
+	struct dc_database *dbs = NULL, *ndbs;
+	char *copy, *p, *item;
+	size_t n = 0, j;
+
+	if ((copy = strdup(list)) == NULL)
+		err(1, NULL);
+	for (p = copy; (item = strsep(&p, ",")) != NULL;) {
+		if (*item == '\0')
+			continue;
+		if (strpbrk(item, "*?[") != NULL) {
+			n = dict_open_all(dictpath, item, &dbs, n);
+			continue;
+		}
+
+		for (j = 0; j < n; j++)
+			if (strcmp(dbs[j].name, item) == 0)
+				break;
+		if (j < n)
+			continue;
+		if ((ndbs = reallocarray(dbs, n + 1, sizeof(*dbs))) == NULL)
+			err(1, NULL);
+		dbs = ndbs;
+		if (dict_open(dictpath, item, &dbs[n]) == -1)
+			exit(1);
+		n++;
+	}
+	free(copy);
+
+	if (n == 0)
+		usage();
+	*dbsp = dbs;
+	return n;
+}
+
+/*
+ * Validate the indexes that have no line table.  This runs once
+ * pledge(2) took away the file system, dictionaries whose index fails
+ * are closed and the rest moved up.
+ */
+static size_t
+dict_validate(struct dc_database *dbs, size_t n)
+{
+	uint64_t start;
+	size_t i, j;
+
+	start = nsec();
+	for (i = j = 0; i < n; i++) {
+		if (dbs[i].index.lines == NULL && index_validate(&dbs[i].index,
+		    dbs[i].size, jobs) == -1) {
+			warnx("index '%s' failed validation",
+			    dbs[i].index.path);
+			dict_close(&dbs[i]);
+			continue;
+		}
+		dbs[j++] = dbs[i];
+	}
+	validate_ns += nsec() - start;
+	return j;
+}
+
+static double
+msec(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+/*
+ * Print the counters of all dictionaries and where the time went.
+ */
+static void
+stats(struct dc_database *dbs, size_t ndbs)
+{
+	struct dc_stats st, sum;
+	size_t i;
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < ndbs; i++) {
+		database_stats(&dbs[i], &st);
+		sum.chunk_hits += st.chunk_hits;
+		sum.chunk_misses += st.chunk_misses;
+		sum.shared_hits += st.shared_hits;
+		sum.z_in += st.z_in;
+		sum.z_out += st.z_out;
+		sum.inflate_ns += st.inflate_ns;
+	}
+	index_stats(&sum);
+
+	fprintf(stderr, "index: %.3f ms open, %.3f ms validate\n",
+	    msec(open_ns), msec(validate_ns));
+	fprintf(stderr, "search: %llu probes, %llu compares, "
+	    "%llu lines parsed, %llu filtered\n",
+	    (unsigned long long)sum.probes, (unsigned long long)sum.compares,
+	    (unsigned long long)sum.parsed, (unsigned long long)sum.filtered);
+	fprintf(stderr, "chunk cache: %llu hits, %llu misses, "
+	    "%llu shared\n", (unsigned long long)sum.chunk_hits,
+	    (unsigned long long)sum.chunk_misses,
+	    (unsigned long long)sum.shared_hits);
+	fprintf(stderr, "inflate: %llu bytes in, %llu bytes out, %.3f ms\n",
+	    (unsigned long long)sum.z_in, (unsigned long long)sum.z_out,
+	    msec(sum.inflate_ns));
+	fprintf(stderr, "lookup: %.3f ms, %llu bytes out\n", msec(lookup_ns),
+	    (unsigned long long)out_bytes);
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct dc_database db;
-	struct dc_index_list list;
-	struct dc_index_entry *res;
-	char *db_path = NULL, *idx_path = NULL;
-	char *lookup, *dictpath;
-	int ch, i, db_fd, idx_fd;
-	int Vflag = 0, dflag = 0, eflag = 0, mflag = 0;
+	struct dc_database *dbs = NULL;
+	const struct dc_strategy *strat;
+	const char *errstr;
+	const char *sname = "prefix";
+	char *name = NULL, *address = NULL;
+	char *dictpath, *env;
+	uint64_t start;
+	size_t ndbs, j;
+	int ch, cache = -1, lfd = -1, wr;
+	int Vflag = 0, bflag = 0, sflag = 0;
 
 	if ((dictpath = getenv("DICT_PATH")) == NULL)
 		dictpath = _FREEDICT_PATH;
+	if ((env = getenv("DICT_STATS")) != NULL && *env != '\0')
+		dc_stats_enabled = 1;
+	if ((env = getenv("DICT_MATERIALIZE")) != NULL && *env != '\0')
+		automat = 1;
+	if ((env = getenv("DICT_SHM")) != NULL && *env != '\0') {
+		shm_size = strtonum(env, 1, SHM_MAX, &errstr) * 1024 * 1024;
+		if (errstr != NULL)
+			errx(1, "DICT_SHM is %s: %s", errstr, env);
+	}
 
-	while ((ch = getopt(argc, argv, "D:Vdem")) != -1) {
+	while ((ch = getopt(argc, argv, "D:MS:Vbc:def:j:l:mo:rst:")) != -1) {
 		switch (ch) {
 		case 'D':
-			asprintf(&db_path, "%s/%s/%s.dict.dz",
-			    dictpath, optarg, optarg);
-			asprintf(&idx_path, "%s/%s/%s.index",
-			    dictpath, optarg, optarg);
+			name = optarg;
+			break;
+		case 'M':
+			Mflag = 1;
+			break;
+		case 'S':
+			address = optarg;
 			break;
 		case 'V':
 			Vflag = 1;
 			break;
+		case 'b':
+			bflag = 1;
+			break;
+		case 'c':
+			cache = strtonum(optarg, 1, UINT16_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "chunks is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			dflag = 1;
 			break;
 		case 'e':
-			eflag = 1;
+			sname = "exact";
+			break;
+		case 'f':
+			sname = "lev";
+			dist = strtonum(optarg, 0, FUZZY_DIST, &errstr);
+			if (errstr != NULL)
+				errx(1, "distance is %s: %s", errstr, optarg);
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, JOBS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			limit = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "limit is %s: %s", errstr, optarg);
 			break;
 		case 'm':
 			mflag = 1;
 			break;
+		case 'o':
+			offset = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "offset is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			sname = "re";
+			break;
+		case 's':
+			sflag = 1;
+			break;
+		case 't':
+			sname = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -129,59 +927,110 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc == 0 || db_path == NULL || idx_path == NULL)
+	if (address != NULL) {
+		if (argc != 0 || name != NULL || bflag || dflag || mflag ||
+		    sflag || Mflag || strcmp(sname, "prefix") != 0)
+			usage();
+	} else if (Mflag) {
+		if (argc != 0 || name == NULL || bflag || dflag || mflag ||
+		    sflag || cache != -1 || strcmp(sname, "prefix") != 0)
+			usage();
+	} else if (name == NULL || (bflag ? argc != 0 : argc == 0))
 		usage();
 
 	if (!dflag)
 		mflag = 1;
+	if (sflag)
+		dc_stats_enabled = 1;
 
-	if (unveil("/usr/local/freedict", "r") == -1)
-		return 1;
-	if (pledge("stdio rpath", NULL) == -1)
-		return 1;
+	/* bind before unveil hides the socket path */
+	if (address != NULL)
+		lfd = server_listen(address);
 
-	if ((db_fd = open(db_path, O_RDONLY)) == -1)
-		err(1, "cannot open dictionary '%s'", db_path);
-	if ((idx_fd = open(idx_path, O_RDONLY)) == -1)
-		err(1, "cannot open index '%s'", idx_path);
-
-	if (pledge("stdio", NULL) == -1)
+	/* the cache is optional, lookups go on without it */
+	if ((text_dir = text_cache()) == NULL && Mflag)
+		errx(1, "no cache directory, set XDG_CACHE_HOME or HOME");
+	if (text_dir != NULL && (Mflag || automat) &&
+	    text_mkdir(text_dir) == -1) {
+		if (Mflag)
+			err(1, "cannot create cache '%s'", text_dir);
+		warn("cannot create cache '%s'", text_dir);
+		free(text_dir);
+		text_dir = NULL;
+	}
+	if (unveil(dictpath, "r") == -1)
+		return 1;
+	if (text_dir != NULL &&
+	    unveil(text_dir, Mflag || automat ? "rwc" : "r") == -1) {
+		/* nothing is cached without its parent */
+		if (errno != ENOENT)
+			return 1;
+		free(text_dir);
+		text_dir = NULL;
+	}
+	/* where shm_open(3) keeps its segments */
+	if (shm_size > 0 && unveil("/tmp", "rwc") == -1)
 		return 1;
 
-	if (database_open(db_fd, &db) == -1)
-		errx(1, "cannot open dictionary '%s'", db_path);
+	/* only the cache and shared memory are ever written */
+	wr = Mflag || automat || shm_size > 0;
 
-	if (index_open(idx_fd, &db.index) == -1)
-		err(1, "cannot open index '%s'", idx_path);
+	if (address != NULL) {
+		if (pledge(wr ? "stdio rpath wpath cpath inet unix" :
+		    "stdio rpath inet unix", NULL) == -1)
+			return 1;
+		if ((ndbs = dict_open_all(dictpath, NULL, &dbs, 0)) == 0)
+			errx(1, "no dictionaries found in '%s'", dictpath);
+		for (j = 0; j < ndbs; j++) {
+			if (cache != -1 && database_cache(&dbs[j], cache) == -1)
+				err(1, "cannot allocate %d chunks", cache);
+			for (strat = index_strategies; strat->name != NULL;
+			    strat++)
+				if (strat->open != NULL &&
+				    strat->open(&dbs[j].index) == -1)
+					warnx("%s: no %s index", dbs[j].name,
+					    strat->name);
+		}
+		if (pledge("stdio inet unix", NULL) == -1)
+			return 1;
+		if (!Vflag && (ndbs = dict_validate(dbs, ndbs)) == 0)
+			return 1;
+		return server_run(lfd, dbs, ndbs);
+	}
 
-	if (!Vflag && index_validate(&db.index, db.size) == -1)
-		errx(1, "index '%s' failed validation", idx_path);
+	if ((strat = index_strategy(sname)) == NULL)
+		errx(1, "unknown strategy: %s", sname);
 
-	SLIST_INIT(&list);
-	if ((res = calloc(MAX_RESULTS, sizeof(struct dc_index_entry))) == NULL)
+	if (pledge(wr ? "stdio rpath wpath cpath" : "stdio rpath", NULL) == -1)
 		return 1;
-	for (i = 0; i < MAX_RESULTS; i++)
-		SLIST_INSERT_HEAD(&list, &res[i], entries);
-
-	for (i = 0; i < argc; i++) {
-		if ((lookup = strdup(argv[i])) == NULL)
-			return 1;
-		for (ch = 0; lookup[ch] != '\0'; ch++)
-			lookup[ch] = tolower(lookup[ch]);
 
-		if (eflag) {
-			index_exact_find(lookup, &db.index, &list);
-		} else {
-			index_prefix_find(lookup, &db.index, &list);
-		}
+	ndbs = dict_open_list(dictpath, name, &dbs);
+	if (Mflag)
+		return 0;
+	for (j = 0; j < ndbs; j++) {
+		if (cache != -1 && database_cache(&dbs[j], cache) == -1)
+			err(1, "cannot allocate %d chunks", cache);
+		if (strat->open != NULL && strat->open(&dbs[j].index) == -1)
+			errx(1, "%s: no %s index", dbs[j].name, strat->name);
+	}
 
-		free(lookup);
+	if (pledge("stdio", NULL) == -1)
+		return 1;
+	if (!Vflag && (ndbs = dict_validate(dbs, ndbs)) == 0)
+		return 1;
 
-		if (mflag)
-			match(&list);
-		if (dflag)
-			define(&db, &list);
+	start = nsec();
+	if (bflag) {
+		if (setvbuf(stdout, NULL, _IOFBF, BATCH_BUFSIZ) != 0)
+			err(1, "setvbuf");
+		batch(dbs, ndbs, strat);
 	}
+	if (argc > 0)
+		lookup(dbs, ndbs, strat, argv, argc);
+	lookup_ns = nsec() - start;
+
+	if (dc_stats_enabled)
+		stats(dbs, ndbs);
 
 	return 0;
 }
@@ -15,27 +15,212 @@
  */
 
 #define WORD_MAX	4095
-#define LOOKUP_MAX	4095
+#define FUZZY_WORD	64	/* longest word matched with a distance */
+#define FUZZY_DIST	4
 
 #define MAX(a,b)	(((a)>(b))?(a):(b))
 #define MIN(a,b)	(((a)<(b))?(a):(b))
 
-SLIST_HEAD(dc_index_list, dc_index_entry);
+#ifndef __OpenBSD__
+long long strtonum(const char *, long long, long long, const char **);
+#endif
+
 struct dc_index_entry {
-	const char 			*match;
-	uint16_t			 match_len;
-	size_t				 def_off;
-	size_t				 def_len;
-	SLIST_ENTRY(dc_index_entry)	 entries;
+	const char 	*match;
+	uint16_t	 match_len;
+	size_t		 def_off;
+	size_t		 def_len;
+	const char	*def;		/* in the text of an overlay */
+};
+
+struct dc_sidecar {
+	void		*map;
+	size_t		 maplen;
+	const void	*data;
+	size_t		 len;
+	size_t		 count;
+};
+
+/*
+ * Record of the line table, foo-bar.index.bin, with a decoded copy of
+ * every index line.
+ */
+struct dc_line {
+	uint64_t	 off;		/* start of the line in the index */
+	uint64_t	 def_off;
+	uint32_t	 def_len;
+	uint16_t	 match_len;
+	uint16_t	 pad;
 };
 
+/*
+ * Derived indexes, like the one of reversed headwords, are sorted by a
+ * key computed from the headwords and have a line table.  src holds
+ * the offset of the line in the source index every line refers to.
+ * The overlay, foo-bar.delta.index, is a small index of entries added
+ * since, with their definitions in its mapped text.  Its lines of
+ * length 0 delete all entries of their headword from the index.
+ * Sidecars missing for an index that is not writable are only built
+ * in memory.
+ */
 struct dc_index {
-	const char 	*data;
-	off_t		 size;
+	const char 		*path;
+	int			 writable;	/* missing sidecars are written */
+	const char 		*data;
+	off_t			 size;
+	struct timespec		 mtime;
+	const struct dc_line	*lines;		/* line table or NULL */
+	size_t			 nlines;
+	struct dc_sidecar	 table;
+	const uint64_t		*src;		/* derived indexes only */
+	struct dc_index		*rev;		/* reversed headwords */
+	struct dc_index		*sdx;		/* Soundex codes */
+	struct dc_trigrams	*tri;
+	struct dc_bloom		*bloom;		/* headword filter or NULL */
+	struct dc_index		*delta;		/* overlay or NULL */
+	const char		*text;		/* definitions of an overlay */
+	size_t			 textlen;
+};
+
+/*
+ * Posting list of a trigram, the offsets of all lines whose headword
+ * contains it are at post[start] to post[start + count - 1].
+ */
+struct dc_gram {
+	uint32_t	 gram;
+	uint32_t	 count;
+	uint64_t	 start;
+};
+
+/*
+ * Trigram index of the headwords, foo-bar.index.tri.
+ */
+struct dc_trigrams {
+	struct dc_sidecar	 sc;
+	const struct dc_gram	*grams;		/* sorted by gram */
+	size_t			 ngrams;
+	const uint32_t		*post;
+	size_t			 npost;
+};
+
+/*
+ * Bloom filter of the headwords, foo-bar.index.bloom.  Each headword
+ * sets k bits in one block of 512 bits, so a lookup touches a single
+ * cache line.
+ */
+struct dc_bloom {
+	struct dc_sidecar	 sc;
+	const uint64_t		*blocks;	/* 8 words per block */
+	size_t			 nblocks;
+	uint32_t		 k;
+};
+
+struct dc_stats {
+	uint64_t	 chunk_hits;
+	uint64_t	 chunk_misses;
+	uint64_t	 shared_hits;	/* misses found in shared memory */
+	uint64_t	 z_in;		/* compressed bytes inflated */
+	uint64_t	 z_out;
+	uint64_t	 inflate_ns;
+	uint64_t	 probes;	/* lines probed by binary searches */
+	uint64_t	 compares;	/* lines compared to a query */
+	uint64_t	 parsed;	/* lines parsed from the index text */
+	uint64_t	 filtered;	/* exact misses found by the filter */
 };
 
+/*
+ * Counters and timings in the hot paths are only kept when this is set,
+ * before any dictionary is opened.
+ */
+extern int dc_stats_enabled;
+
+/*
+ * Static tracepoints for perf, bpftrace or dtrace, when built with
+ * <sys/sdt.h>.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define DC_PROBE1(name, a)	DTRACE_PROBE1(opendict, name, a)
+#define DC_PROBE2(name, a, b)	DTRACE_PROBE2(opendict, name, a, b)
+#else
+#define DC_PROBE1(name, a)
+#define DC_PROBE2(name, a, b)
+#endif
+
 struct dc_database {
+	char		*name;
 	void		*data;
 	off_t		 size;
 	struct dc_index	 index;
 };
+
+/*
+ * A lower cased word to look up, with its length.
+ */
+struct dc_query {
+	const char	*word;
+	size_t		 len;
+	size_t		 dist;		/* edit distance for fuzzy matches */
+	int		 jobs;		/* threads for scans of the index */
+};
+
+struct dc_index_iter;
+
+/*
+ * Strategies with a key function search the derived index returned by
+ * view, which open loads or builds.  Strategies without a comparator
+ * walk the index themselves in next, after begin set up the iterator.
+ * begin fails if the query is invalid, like a malformed pattern.
+ */
+struct dc_strategy {
+	const char	*name;
+	const char	*desc;
+	int		(*compar)(const struct dc_query *, const char *,
+			    const char *);
+	size_t		(*key)(char *, size_t);
+	int		(*open)(struct dc_index *);
+	const struct dc_index *(*view)(const struct dc_index *);
+	int		(*begin)(struct dc_index_iter *);
+	struct dc_index_entry *(*next)(struct dc_index_iter *,
+			    struct dc_index_entry *);
+};
+
+/*
+ * Rows of the edit distance table between the query and the prefixes
+ * of word, up to depth.
+ */
+struct dc_fuzzy {
+	const char	*word;
+	size_t		 depth;
+	uint8_t		 rows[FUZZY_WORD + FUZZY_DIST + 2][FUZZY_WORD + 1];
+};
+
+/*
+ * Iterates over the lines of an index that match a key, positions are
+ * as described in index.c.
+ */
+struct dc_index_iter {
+	const struct dc_index	*idx;
+	const struct dc_index	*view;		/* idx or derived from it */
+	struct dc_query		 key;
+	int			(*compar)(const struct dc_query *,
+				    const char *, const char *);
+	struct dc_index_entry	*(*next)(struct dc_index_iter *,
+				    struct dc_index_entry *);
+	off_t			 pos;
+	size_t			 left;		/* results until the limit */
+	struct dc_fuzzy		 fuzzy;
+	const uint32_t		*cand;		/* candidate lines or NULL */
+	const uint32_t		*cand_end;
+	off_t			*found;		/* lines found by a scan */
+	size_t			 nfound;
+	size_t			 next_found;
+	struct dc_index_iter	*delta;		/* of the overlay or NULL */
+	size_t			(*order)(char *, size_t); /* key of the view */
+	struct dc_index_entry	 head[2];	/* next of index and overlay */
+	int			 heads;
+	size_t			 merged_left;
+};
+
+int dict_open(const char *, const char *, struct dc_database *);
+void dict_close(struct dc_database *);
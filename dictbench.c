@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the index and database code, usually run on the
+ * output of dictgen by "make bench".  Every benchmark is repeated until
+ * it took the minimum time, the mean is reported.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "dict.h"
+#include "index.h"
+
+#define BENCH_QUERIES	4096
+#define BENCH_MSEC	500	/* default minimum time per benchmark */
+#define BENCH_CHECK	16
+
+struct bench {
+	struct dc_database	 db;
+	struct dc_index		 raw;		/* without a line table */
+	struct dc_index_entry	*entries;
+	size_t			 nentries;
+	char			*words[BENCH_QUERIES];
+	size_t			 nwords;
+	int			 jobs;
+};
+
+static uint64_t min_ns = BENCH_MSEC * 1000000ULL;
+static volatile size_t sink;
+
+static __dead void
+usage(void)
+{
+	fputs("usage: dictbench [-j jobs] [-t msec] index dict\n", stderr);
+	exit(1);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Throughput is only given for benchmarks that process bytes.
+ */
+static void
+report(const char *name, uint64_t ops, uint64_t bytes, uint64_t ns)
+{
+	printf("%-20s %10llu %12.1f", name, (unsigned long long)ops,
+	    (double)ns / ops);
+	if (bytes > 0)
+		printf(" %10.1f", bytes / ((double)ns / 1e9) / 1e6);
+	putchar('\n');
+}
+
+static void
+bench_validate(struct bench *b)
+{
+	struct dc_index idx;
+	uint64_t start, ns, ops = 0;
+
+	start = now();
+	do {
+		idx = b->raw;
+		if (index_validate(&idx, b->db.size, b->jobs) == -1)
+			errx(1, "index failed validation");
+		free((void *)idx.lines);
+		ops++;
+	} while ((ns = now() - start) < min_ns);
+
+	report("index_validate", ops, ops * b->raw.size, ns);
+}
+
+/*
+ * Every line is parsed by the iterator when there is no line table.
+ */
+static void
+bench_parse(struct bench *b)
+{
+	const struct dc_strategy *strat = index_strategy("prefix");
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_query q;
+	char empty[1] = "";
+	uint64_t start, ns, ops = 0, bytes = 0;
+
+	index_query(&q, strat, empty);
+	start = now();
+	do {
+		index_iter_begin(&it, strat, &q, &b->raw);
+		while (index_iter_next(&it, &e) != NULL)
+			ops++;
+		index_iter_end(&it);
+		bytes += b->raw.size;
+	} while ((ns = now() - start) < min_ns);
+
+	report("index_parse_line", ops, bytes, ns);
+}
+
+/*
+ * Position an iterator on the first match of every query, that is one
+ * binary search for the strategies with a comparator.
+ */
+static void
+bench_search(struct bench *b, const struct dc_index *idx,
+    const struct dc_strategy *strat, const char *label, int drain)
+{
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_query *qs, *q;
+	char name[64], **words;
+	uint64_t start, ns, ops = 0;
+	size_t i;
+
+	if (strat->open != NULL && strat->open((struct dc_index *)idx) == -1)
+		errx(1, "cannot open the index of %s", strat->name);
+
+	/* keys are never longer than the word */
+	if ((qs = calloc(b->nwords, sizeof(*qs))) == NULL ||
+	    (words = calloc(b->nwords, sizeof(*words))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < b->nwords; i++) {
+		if ((words[i] = strdup(b->words[i])) == NULL)
+			err(1, NULL);
+		index_query(&qs[i], strat, words[i]);
+	}
+
+	/* scans take long, so the time is checked every few queries */
+	start = now();
+	do {
+		for (i = 0; i < BENCH_CHECK; i++, ops++) {
+			q = &qs[ops % b->nwords];
+			if (index_iter_begin(&it, strat, q, idx) == -1)
+				errx(1, "invalid pattern: %s", q->word);
+			if (drain)
+				while (index_iter_next(&it, &e) != NULL)
+					sink++;
+			else
+				sink += it.pos;
+			index_iter_end(&it);
+		}
+	} while ((ns = now() - start) < min_ns);
+
+	snprintf(name, sizeof(name), "%s %s", label, strat->name);
+	report(name, ops, 0, ns);
+	for (i = 0; i < b->nwords; i++)
+		free(words[i]);
+	free(words);
+	free(qs);
+}
+
+/*
+ * Read the definitions in index order, mostly from cached chunks, or at
+ * random with a single chunk, which inflates most of the time.
+ */
+static void
+bench_read(struct bench *b, const char *name, size_t nchunks, int random)
+{
+	struct dc_reader *r;
+	char *buf;
+	uint64_t start, ns, ops = 0, bytes = 0;
+	size_t i, j, max = 1;
+
+	for (i = 0; i < b->nentries; i++)
+		max = MAX(max, b->entries[i].def_len);
+	if ((r = database_reader(&b->db, nchunks)) == NULL ||
+	    (buf = malloc(max)) == NULL)
+		err(1, NULL);
+
+	start = now();
+	do {
+		for (i = 0; i < BENCH_QUERIES; i++, ops++) {
+			j = random ? (ops * 2654435761U) % b->nentries :
+			    ops % b->nentries;
+			if (database_read(r, &b->entries[j], buf) == -1)
+				errx(1, "cannot read definition %zu", j);
+			bytes += b->entries[j].def_len;
+		}
+	} while ((ns = now() - start) < min_ns);
+
+	report(name, ops, bytes, ns);
+	database_reader_free(r);
+	free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct dc_strategy *strat;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_index idx;
+	struct dc_query q;
+	struct bench b;
+	const char *errstr;
+	char empty[1] = "";
+	size_t i, step;
+	int ch, fd;
+
+	memset(&b, 0, sizeof(b));
+	b.jobs = 1;
+	while ((ch = getopt(argc, argv, "j:t:")) != -1) {
+		switch (ch) {
+		case 'j':
+			b.jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			min_ns = strtonum(optarg, 1, 3600000, &errstr) *
+			    1000000ULL;
+			if (errstr != NULL)
+				errx(1, "time is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+
+	if ((fd = open(argv[1], O_RDONLY)) == -1)
+		err(1, "%s", argv[1]);
+	if (database_open(fd, &b.db) == -1)
+		errx(1, "cannot open dictionary '%s'", argv[1]);
+	close(fd);
+	if ((fd = open(argv[0], O_RDONLY)) == -1)
+		err(1, "%s", argv[0]);
+	b.raw.path = argv[0];
+	if (index_open(fd, &b.raw) == -1)
+		err(1, "cannot open index '%s'", argv[0]);
+	close(fd);
+
+	/* derived indexes hang off the one with the line table */
+	idx = b.raw;
+	if (index_validate(&idx, b.db.size, b.jobs) == -1)
+		errx(1, "index '%s' failed validation", argv[0]);
+
+	strat = index_strategy("prefix");
+	index_query(&q, strat, empty);
+	index_iter_begin(&it, strat, &q, &idx);
+	while (index_iter_next(&it, &e) != NULL) {
+		if ((b.nentries & (b.nentries + 1)) == 0 &&
+		    (b.entries = reallocarray(b.entries, b.nentries * 2 + 1,
+		    sizeof(*b.entries))) == NULL)
+			err(1, NULL);
+		b.entries[b.nentries++] = e;
+	}
+	index_iter_end(&it);
+	if (b.nentries == 0)
+		errx(1, "index '%s' is empty", argv[0]);
+
+	/* headwords spread over the index, and a miss after each */
+	step = MAX(1, b.nentries / (BENCH_QUERIES / 2));
+	for (i = 0; i < b.nentries && b.nwords + 1 < BENCH_QUERIES;
+	    i += step) {
+		if ((b.words[b.nwords++] = strndup(b.entries[i].match,
+		    b.entries[i].match_len)) == NULL ||
+		    asprintf(&b.words[b.nwords++], "%.*sq!",
+		    b.entries[i].match_len, b.entries[i].match) == -1)
+			err(1, NULL);
+	}
+
+	printf("%-20s %10s %12s %10s\n", "benchmark", "ops", "ns/op", "MB/s");
+	bench_validate(&b);
+	bench_parse(&b);
+	for (strat = index_strategies; strat->name != NULL; strat++) {
+		if (strat->compar == NULL)
+			continue;
+		/* derived indexes always have a line table */
+		if (strat->view == NULL)
+			bench_search(&b, &b.raw, strat, "bsearch -V", 0);
+		bench_search(&b, &idx, strat, "bsearch", 0);
+	}
+	for (strat = index_strategies; strat->name != NULL; strat++)
+		bench_search(&b, &idx, strat, "match", 1);
+	bench_read(&b, "gz_read seq", 8, 0);
+	bench_read(&b, "gz_read random", 1, 1);
+
+	return 0;
+}
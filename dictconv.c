@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Convert a dictionary to the seekable format of zstd, one frame per
+ * chunk followed by a skippable frame with their sizes.  LZ4 frames
+ * use the same layout.  Either is read by database_open() and by the
+ * zstd and lz4 utilities.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "database.h"
+#include "dict.h"
+
+#define SEEK_SKIPPABLE	0x184D2A5E
+#define SEEK_MAGIC	0x8F92EAB1
+#define CONV_CHUNK	65536
+#define CONV_CHUNK_MAX	(16 * 1024 * 1024)	/* as read by database.c */
+
+struct conv_codec {
+	const char	*name;
+	size_t		(*bound)(size_t);
+	size_t		(*compress)(void *, size_t, const void *, size_t, int);
+};
+
+#ifdef HAVE_ZSTD
+static size_t
+zstd_bound(size_t len)
+{
+	return ZSTD_compressBound(len);
+}
+
+static size_t
+zstd_compress(void *dst, size_t cap, const void *src, size_t len, int level)
+{
+	size_t n;
+
+	n = ZSTD_compress(dst, cap, src, len, level);
+	return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static void
+lz4_prefs(LZ4F_preferences_t *prefs, size_t len, int level)
+{
+	memset(prefs, 0, sizeof(*prefs));
+	prefs->frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs->frameInfo.contentSize = len;
+	prefs->compressionLevel = level;
+}
+
+static size_t
+lz4_bound(size_t len)
+{
+	LZ4F_preferences_t prefs;
+
+	lz4_prefs(&prefs, len, 0);
+	return LZ4F_compressFrameBound(len, &prefs);
+}
+
+static size_t
+lz4_compress(void *dst, size_t cap, const void *src, size_t len, int level)
+{
+	LZ4F_preferences_t prefs;
+	size_t n;
+
+	lz4_prefs(&prefs, len, level);
+	n = LZ4F_compressFrame(dst, cap, src, len, &prefs);
+	return LZ4F_isError(n) ? 0 : n;
+}
+#endif
+
+static const struct conv_codec codecs[] = {
+#ifdef HAVE_ZSTD
+	{ "zstd",	zstd_bound,	zstd_compress },
+#endif
+#ifdef HAVE_LZ4
+	{ "lz4",	lz4_bound,	lz4_compress },
+#endif
+	{ NULL,		NULL,		NULL }
+};
+
+static __dead void
+usage(void)
+{
+	fputs("usage: dictconv [-c chunk] [-l level] [-t format] input "
+	    "output\n", stderr);
+	exit(1);
+}
+
+static void
+put_le32(FILE *fp, uint32_t v)
+{
+	putc(v & 0xff, fp);
+	putc((v >> 8) & 0xff, fp);
+	putc((v >> 16) & 0xff, fp);
+	putc((v >> 24) & 0xff, fp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct conv_codec *codec = codecs;
+	struct dc_database db;
+	struct dc_reader *r;
+	FILE *fp;
+	const char *errstr, *p;
+	char *in, *out, *tmp;
+	uint32_t *csizes, *dsizes;
+	size_t clen = CONV_CHUNK, len = 0, cap, n, nframes = 0, maxframes;
+	size_t i, nchunks;
+	ssize_t dlen;
+	int ch, fd, level = 0;
+
+	while ((ch = getopt(argc, argv, "c:l:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			clen = strtonum(optarg, 1024, CONV_CHUNK_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "chunk size is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			level = strtonum(optarg, 0, 22, &errstr);
+			if (errstr != NULL)
+				errx(1, "level is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			for (codec = codecs; codec->name != NULL; codec++)
+				if (strcmp(codec->name, optarg) == 0)
+					break;
+			if (codec->name == NULL)
+				errx(1, "unknown format: %s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+	if (codec->name == NULL)
+		errx(1, "built without zstd and lz4");
+
+	if ((fd = open(argv[0], O_RDONLY)) == -1)
+		err(1, "%s", argv[0]);
+	memset(&db, 0, sizeof(db));
+	if (database_open(fd, &db) == -1)
+		errx(1, "cannot open dictionary '%s'", argv[0]);
+	close(fd);
+	if ((r = database_reader(&db, 1)) == NULL)
+		err(1, NULL);
+
+	/* the output is never shorter than the input, but for the end */
+	maxframes = db.size / clen + 2;
+	cap = codec->bound(clen);
+	if ((in = malloc(clen)) == NULL || (out = malloc(cap)) == NULL ||
+	    (csizes = calloc(maxframes, sizeof(*csizes))) == NULL ||
+	    (dsizes = calloc(maxframes, sizeof(*dsizes))) == NULL)
+		err(1, NULL);
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", argv[1]) == -1)
+		err(1, NULL);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "%s", tmp);
+	if (fchmod(fd, 0644) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		err(1, "%s", tmp);
+
+	nchunks = database_nchunks(&db);
+	for (i = 0; i <= nchunks; i++) {
+		dlen = 0;
+		if (i < nchunks &&
+		    (dlen = database_chunk(r, i, &p)) == -1)
+			errx(1, "cannot read chunk %zu of '%s'", i, argv[0]);
+		while (dlen > 0 || (i == nchunks && len > 0)) {
+			n = MIN((size_t)dlen, clen - len);
+			memcpy(in + len, p, n);
+			len += n;
+			p += n;
+			dlen -= n;
+			if (len < clen && i < nchunks)
+				break;
+
+			if ((n = codec->compress(out, cap, in, len,
+			    level)) == 0)
+				errx(1, "cannot compress frame %zu", nframes);
+			if (fwrite(out, 1, n, fp) != n)
+				err(1, "%s", tmp);
+			csizes[nframes] = n;
+			dsizes[nframes++] = len;
+			len = 0;
+		}
+	}
+
+	put_le32(fp, SEEK_SKIPPABLE);
+	put_le32(fp, nframes * 8 + 9);
+	for (i = 0; i < nframes; i++) {
+		put_le32(fp, csizes[i]);
+		put_le32(fp, dsizes[i]);
+	}
+	put_le32(fp, nframes);
+	putc(0, fp);	/* no checksums */
+	put_le32(fp, SEEK_MAGIC);
+	if (fclose(fp) == EOF)
+		err(1, "%s", tmp);
+	if (rename(tmp, argv[1]) == -1)
+		err(1, "rename %s", argv[1]);
+
+	free(tmp);
+	free(dsizes);
+	free(csizes);
+	free(out);
+	free(in);
+	database_reader_free(r);
+	database_close(&db);
+	return 0;
+}
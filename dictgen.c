@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Write a synthetic dictionary, name.index and name.dict.dz, for the
+ * benchmarks.  The same seed always gives the same files.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "dict.h"
+
+#define GEN_WORD_MIN	2
+#define GEN_WORD_MAX	14
+#define GEN_LOREM	24	/* most " lorem ipsum" per definition */
+#define RA_CHUNKS_MAX	((UINT16_MAX - 10) / 2)	/* fit the extra field */
+
+struct word {
+	char	w[GEN_WORD_MAX + 1];
+};
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static __dead void
+usage(void)
+{
+	fputs("usage: dictgen [-c chunk] [-n words] [-s seed] name\n", stderr);
+	exit(1);
+}
+
+/* xorshift64*, reproducible unlike arc4random(3) */
+static uint32_t
+gen_random(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return (state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static int
+word_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct word *)a)->w, ((const struct word *)b)->w);
+}
+
+static void
+put_b64(FILE *fp, uint64_t v)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char buf[12];
+	int i = sizeof(buf);
+
+	do {
+		buf[--i] = b64[v & 63];
+		v >>= 6;
+	} while (v != 0);
+	fwrite(buf + i, 1, sizeof(buf) - i, fp);
+}
+
+static void
+put_int16(FILE *fp, unsigned int v)
+{
+	putc(v & 0xff, fp);
+	putc((v >> 8) & 0xff, fp);
+}
+
+static void
+put_int32(FILE *fp, uint32_t v)
+{
+	put_int16(fp, v & 0xffff);
+	put_int16(fp, v >> 16);
+}
+
+/*
+ * Every chunk ends with a full flush, so it can be inflated on its own
+ * as dictzip requires.
+ */
+static void
+write_dictzip(const char *path, const char *text, size_t len, size_t clen)
+{
+	z_stream z;
+	FILE *fp;
+	u_char *out;
+	uint16_t *sizes;
+	size_t i, n, outlen, off = 0;
+
+	n = (len + clen - 1) / clen;
+	if (n > RA_CHUNKS_MAX)
+		errx(1, "too many chunks, use a larger chunk size");
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(1, "deflateInit2");
+	/* every flush adds a few bytes */
+	outlen = deflateBound(&z, len) + n * 16;
+	if ((sizes = calloc(n, sizeof(*sizes))) == NULL ||
+	    (out = malloc(outlen)) == NULL)
+		err(1, NULL);
+	z.next_out = out;
+	z.avail_out = outlen;
+	for (i = 0; i < n; i++) {
+		z.next_in = (u_char *)text + i * clen;
+		z.avail_in = MIN(clen, len - i * clen);
+		if (deflate(&z, i == n - 1 ? Z_FINISH : Z_FULL_FLUSH) ==
+		    Z_STREAM_ERROR || z.avail_in != 0)
+			errx(1, "deflate");
+		if (z.total_out - off > UINT16_MAX)
+			errx(1, "chunk %zu does not compress", i);
+		sizes[i] = z.total_out - off;
+		off = z.total_out;
+	}
+	deflateEnd(&z);
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	fwrite("\x1f\x8b\x08\x04", 1, 4, fp);	/* magic, deflate, FEXTRA */
+	put_int32(fp, 0);			/* mtime */
+	putc(0, fp);				/* xflags */
+	putc(3, fp);				/* OS, Unix */
+	put_int16(fp, 4 + 6 + 2 * n);
+	putc('R', fp);
+	putc('A', fp);
+	put_int16(fp, 6 + 2 * n);
+	put_int16(fp, 1);			/* version */
+	put_int16(fp, clen);
+	put_int16(fp, n);
+	for (i = 0; i < n; i++)
+		put_int16(fp, sizes[i]);
+	fwrite(out, 1, off, fp);
+	put_int32(fp, crc32(crc32(0, NULL, 0), (const u_char *)text, len));
+	put_int32(fp, len);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+
+	free(out);
+	free(sizes);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct word *words;
+	FILE *fp;
+	char *path, *text = NULL;
+	const char *errstr;
+	size_t i, j, k, n = 100000, clen = UINT16_MAX, len = 0, size = 0;
+	size_t start;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:n:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			clen = strtonum(optarg, 1024, UINT16_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "chunk size is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of words is %s: %s", errstr,
+				    optarg);
+			break;
+		case 's':
+			state += strtonum(optarg, 0, UINT32_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if ((words = calloc(n, sizeof(*words))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++) {
+		k = GEN_WORD_MIN + gen_random() % (GEN_WORD_MAX - GEN_WORD_MIN);
+		for (j = 0; j < k; j++)
+			words[i].w[j] = 'a' + gen_random() % 26;
+	}
+	qsort(words, n, sizeof(*words), word_cmp);
+
+	if (asprintf(&path, "%s.index", argv[0]) == -1)
+		err(1, NULL);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	free(path);
+
+	/* duplicate headwords are kept, real dictionaries have them too */
+	for (i = 0; i < n; i++) {
+		k = 1 + gen_random() % GEN_LOREM;
+		if (len + 2 * GEN_WORD_MAX + 32 + k * 12 > size) {
+			size = size ? size * 2 : 1024 * 1024;
+			if ((text = realloc(text, size)) == NULL)
+				err(1, NULL);
+		}
+		start = len;
+		len += sprintf(text + len, "%s\n  definition of %s",
+		    words[i].w, words[i].w);
+		for (j = 0; j < k; j++)
+			len += sprintf(text + len, " lorem ipsum");
+		text[len++] = '\n';
+
+		fputs(words[i].w, fp);
+		putc('\t', fp);
+		put_b64(fp, start);
+		putc('\t', fp);
+		put_b64(fp, len - start);
+		putc('\n', fp);
+	}
+	if (fclose(fp) == EOF)
+		err(1, "%s.index", argv[0]);
+
+	if (asprintf(&path, "%s.dict.dz", argv[0]) == -1)
+		err(1, NULL);
+	write_dictzip(path, text, len, clen);
+	free(path);
+
+	free(text);
+	free(words);
+	return 0;
+}
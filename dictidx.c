@@ -0,0 +1,983 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build name.index and name.dict.dz from a tab file, one entry per
+ * line: the headword, an HT and the definition, in which \n stands for
+ * a newline, \t for an HT and \\ for a backslash.  Definitions are
+ * written in input order.  The index lines are sorted by threads in
+ * runs of bounded memory, which spill to temporary files and are merged
+ * into the index.  The chunks of the database are compressed by threads
+ * as well.
+ *
+ * A Bloom filter of the headwords, name.index.bloom, lets exact lookups
+ * of missing words skip the search.
+ *
+ * Entries may instead be added to the overlay, name.delta.index and
+ * name.delta.dict, which is merged into the dictionary by compacting.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "database.h"
+#include "dict.h"
+#include "index.h"
+
+#define IDX_CHUNK	58315	/* of dictzip, compressed chunks fit 16 bits */
+#define IDX_MEMORY	256	/* megabytes of index lines sorted at once */
+#define IDX_BATCH	16	/* chunks compressed per thread at once */
+#define RA_CHUNKS_MAX	((UINT16_MAX - 10) / 2)	/* fit the extra field */
+
+/*
+ * An index line, seq keeps duplicate headwords in input order.
+ */
+struct rec {
+	uint64_t	 off;
+	uint64_t	 len;
+	uint64_t	 seq;
+	size_t		 word;		/* in the pool */
+	uint16_t	 wlen;
+};
+
+/*
+ * A sorted part in memory or a run spilled to a file, merged by the
+ * record at its head.
+ */
+struct source {
+	const struct rec *r, *end;
+	FILE		*fp;
+	struct rec	 cur;
+	const char	*word;
+	char		 buf[WORD_MAX];
+};
+
+struct deflater {
+	const u_char	*text;
+	size_t		 len;
+	size_t		 clen;
+	size_t		 first;		/* chunk of out[0] */
+	size_t		 n;
+	size_t		 next;
+	u_char		**out;
+	size_t		*outlen;
+	uLong		*crc;
+	size_t		 cap;
+	int		 level;
+	int		 error;
+};
+
+static char *pool;
+static size_t poollen;
+static struct rec *recs;
+static size_t nrecs, maxrecs;
+static size_t memory = IDX_MEMORY * 1024 * 1024;
+static FILE **runs;
+static size_t nruns;
+static uint64_t nseq;
+static int jobs = 1;
+static int overlay;	/* sorted in memory only */
+
+/* removed once compacted, with the sidecars of the index */
+static const char *const delta_files[] = {
+	".delta.index", ".delta.index.bin", ".delta.index.rev",
+	".delta.index.sdx", ".delta.index.tri", ".delta.dict", NULL
+};
+
+static __dead void
+usage(void)
+{
+	fputs("usage: dictidx [-s] [-F rate] [-c chunk] [-j jobs] [-l level] "
+	    "[-m megabytes]\n"
+	    "               input name\n"
+	    "       dictidx -a [-m megabytes] input name\n"
+	    "       dictidx -C [-s] [-F rate] [-c chunk] [-j jobs] [-l level] "
+	    "[-m megabytes]\n"
+	    "               name\n", stderr);
+	exit(1);
+}
+
+static void
+put_b64(FILE *fp, uint64_t v)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char buf[12];
+	int i = sizeof(buf);
+
+	do {
+		buf[--i] = b64[v & 63];
+		v >>= 6;
+	} while (v != 0);
+	fwrite(buf + i, 1, sizeof(buf) - i, fp);
+}
+
+static void
+put_int16(FILE *fp, unsigned int v)
+{
+	putc(v & 0xff, fp);
+	putc((v >> 8) & 0xff, fp);
+}
+
+static void
+put_int32(FILE *fp, uint32_t v)
+{
+	put_int16(fp, v & 0xffff);
+	put_int16(fp, v >> 16);
+}
+
+static void
+put_line(FILE *fp, const char *word, const struct rec *r)
+{
+	fwrite(word, 1, r->wlen, fp);
+	putc('\t', fp);
+	put_b64(fp, r->off);
+	putc('\t', fp);
+	put_b64(fp, r->len);
+	putc('\n', fp);
+}
+
+/*
+ * Headwords in the order of the index, shorter ones first, as if
+ * terminated by their HT.
+ */
+static int
+rec_cmp(const struct rec *a, const char *wa, const struct rec *b,
+    const char *wb)
+{
+	int r;
+
+	if ((r = memcmp(wa, wb, MIN(a->wlen, b->wlen))) != 0)
+		return r;
+	if (a->wlen != b->wlen)
+		return a->wlen < b->wlen ? -1 : 1;
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int
+rec_qsort_cmp(const void *a, const void *b)
+{
+	const struct rec *ra = a, *rb = b;
+
+	return rec_cmp(ra, pool + ra->word, rb, pool + rb->word);
+}
+
+static void *
+sort_worker(void *arg)
+{
+	struct source *src = arg;
+
+	qsort((void *)src->r, src->end - src->r, sizeof(*src->r),
+	    rec_qsort_cmp);
+	return NULL;
+}
+
+/*
+ * Load the next record of a source, return -1 once it is empty.
+ */
+static int
+source_next(struct source *src)
+{
+	if (src->fp == NULL) {
+		if (src->r == src->end)
+			return -1;
+		src->cur = *src->r++;
+		src->word = pool + src->cur.word;
+		return 0;
+	}
+
+	if (fread(&src->cur, sizeof(src->cur), 1, src->fp) != 1) {
+		if (ferror(src->fp))
+			err(1, "read run");
+		return -1;
+	}
+	if (src->cur.wlen > sizeof(src->buf) ||
+	    fread(src->buf, 1, src->cur.wlen, src->fp) != src->cur.wlen)
+		errx(1, "short run");
+	src->word = src->buf;
+	return 0;
+}
+
+static int
+source_less(const struct source *a, const struct source *b)
+{
+	return rec_cmp(&a->cur, a->word, &b->cur, b->word) < 0;
+}
+
+static void
+heap_down(struct source **heap, size_t n, size_t i)
+{
+	struct source *t;
+	size_t c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && source_less(heap[c + 1], heap[c]))
+			c++;
+		if (!source_less(heap[c], heap[i]))
+			break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+/*
+ * Merge the sorted sources with a heap of their heads and write every
+ * record to a run, or as an index line if run is 0.
+ */
+static void
+merge(struct source *srcs, size_t nsrcs, FILE *fp, int run)
+{
+	struct source **heap, *s;
+	size_t i, n = 0;
+
+	if ((heap = calloc(nsrcs, sizeof(*heap))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nsrcs; i++)
+		if (source_next(&srcs[i]) == 0)
+			heap[n++] = &srcs[i];
+	for (i = n / 2; i-- > 0;)
+		heap_down(heap, n, i);
+
+	while (n > 0) {
+		s = heap[0];
+		if (run) {
+			fwrite(&s->cur, sizeof(s->cur), 1, fp);
+			fwrite(s->word, 1, s->cur.wlen, fp);
+		} else
+			put_line(fp, s->word, &s->cur);
+		if (source_next(s) == -1)
+			heap[0] = heap[--n];
+		heap_down(heap, n, 0);
+	}
+	if (ferror(fp))
+		err(1, "write");
+	free(heap);
+}
+
+/*
+ * Sort the records in memory, split into a part per thread, and merge
+ * the parts into fp.
+ */
+static void
+sort_recs(FILE *fp, int run)
+{
+	struct source *parts;
+	pthread_t *threads;
+	size_t i, n, step;
+	int started;
+
+	n = MAX(1, MIN((size_t)jobs, nrecs / 4096));
+	step = (nrecs + n - 1) / n;
+	if ((parts = calloc(n, sizeof(*parts))) == NULL ||
+	    (threads = calloc(n, sizeof(*threads))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++) {
+		parts[i].r = recs + MIN(nrecs, i * step);
+		parts[i].end = recs + MIN(nrecs, (i + 1) * step);
+	}
+
+	for (started = 1; (size_t)started < n; started++)
+		if (pthread_create(&threads[started], NULL, sort_worker,
+		    &parts[started]) != 0)
+			break;
+	sort_worker(&parts[0]);
+	for (i = 1; i < n; i++) {
+		if (i < (size_t)started)
+			pthread_join(threads[i], NULL);
+		else
+			sort_worker(&parts[i]);
+	}
+
+	merge(parts, n, fp, run);
+	free(threads);
+	free(parts);
+}
+
+/*
+ * Write the records in memory to a sorted run and start over.
+ */
+static void
+spill(void)
+{
+	FILE *fp, **nr;
+
+	if (overlay)
+		errx(1, "overlay too large, compact it or use -m");
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	sort_recs(fp, 1);
+	if (fflush(fp) == EOF)
+		err(1, "write run");
+	rewind(fp);
+
+	if ((nr = reallocarray(runs, nruns + 1, sizeof(*runs))) == NULL)
+		err(1, NULL);
+	runs = nr;
+	runs[nruns++] = fp;
+	nrecs = 0;
+	poollen = 0;
+}
+
+static void
+add_rec(const char *word, size_t wlen, uint64_t off, uint64_t len,
+    uint64_t seq)
+{
+	struct rec *r;
+	size_t i;
+
+	if (poollen + wlen + (nrecs + 1) * sizeof(*recs) > memory)
+		spill();
+	if (nrecs == maxrecs) {
+		maxrecs = maxrecs ? maxrecs * 2 : 4096;
+		if ((r = reallocarray(recs, maxrecs, sizeof(*recs))) == NULL)
+			err(1, NULL);
+		recs = r;
+	}
+
+	/* the key of index_query() */
+	for (i = 0; i < wlen; i++)
+		pool[poollen + i] = tolower((u_char)word[i]);
+	r = &recs[nrecs++];
+	r->off = off;
+	r->len = len;
+	r->seq = seq;
+	r->word = poollen;
+	r->wlen = wlen;
+	poollen += wlen;
+}
+
+/*
+ * Write the entry as the headword on a line of its own followed by the
+ * indented definition.  Return its length.
+ */
+static size_t
+put_entry(FILE *fp, const char *word, size_t wlen, const char *def,
+    size_t dlen)
+{
+	size_t i, n;
+
+	fwrite(word, 1, wlen, fp);
+	fputs("\n  ", fp);
+	n = wlen + 3;
+	for (i = 0; i < dlen; i++) {
+		if (def[i] == '\\' && i + 1 < dlen) {
+			switch (def[++i]) {
+			case 'n':
+				fputs("\n  ", fp);
+				n += 3;
+				continue;
+			case 't':
+				putc('\t', fp);
+				n++;
+				continue;
+			case '\\':
+				putc('\\', fp);
+				n++;
+				continue;
+			}
+			i--;
+		}
+		putc(def[i], fp);
+		n++;
+	}
+	putc('\n', fp);
+	return n + 1;
+}
+
+static void *
+deflate_worker(void *arg)
+{
+	struct deflater *d = arg;
+	z_stream z;
+	size_t i, chunk, len, nchunks;
+
+	nchunks = (d->len + d->clen - 1) / d->clen;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, d->level, Z_DEFLATED, -MAX_WBITS, 9,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		__atomic_store_n(&d->error, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	while (!__atomic_load_n(&d->error, __ATOMIC_RELAXED) &&
+	    (i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) < d->n) {
+		chunk = d->first + i;
+		len = MIN(d->clen, d->len - chunk * d->clen);
+		/* a full flush ends every chunk on a byte of its own */
+		deflateReset(&z);
+		z.next_in = (u_char *)d->text + chunk * d->clen;
+		z.avail_in = len;
+		z.next_out = d->out[i];
+		z.avail_out = d->cap;
+		if (deflate(&z, chunk == nchunks - 1 ? Z_FINISH :
+		    Z_FULL_FLUSH) == Z_STREAM_ERROR || z.avail_in != 0 ||
+		    d->cap - z.avail_out > UINT16_MAX) {
+			__atomic_store_n(&d->error, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		d->outlen[i] = d->cap - z.avail_out;
+		d->crc[i] = crc32(crc32(0, NULL, 0), z.next_in - len, len);
+	}
+	deflateEnd(&z);
+	return NULL;
+}
+
+/*
+ * Compress the text to a dictzip file.  Every chunk is deflated on its
+ * own, batches of them by all threads, and written in order once its
+ * batch is done.  The sizes in the header are filled in last.
+ */
+static void
+write_dictzip(FILE *fp, const char *path, const u_char *text, size_t len,
+    size_t clen, int level)
+{
+	struct deflater d;
+	pthread_t *threads;
+	uint16_t *sizes;
+	uLong crc = crc32(0, NULL, 0);
+	size_t i, n, batch, nchunks;
+	int started;
+
+	nchunks = (len + clen - 1) / clen;
+	if (nchunks > RA_CHUNKS_MAX)
+		errx(1, "too many chunks, use a larger chunk size");
+
+	memset(&d, 0, sizeof(d));
+	d.text = text;
+	d.len = len;
+	d.clen = clen;
+	d.level = level;
+	d.cap = compressBound(clen) + 16;
+	batch = (size_t)jobs * IDX_BATCH;
+	if ((sizes = calloc(nchunks, sizeof(*sizes))) == NULL ||
+	    (d.out = calloc(batch, sizeof(*d.out))) == NULL ||
+	    (d.outlen = calloc(batch, sizeof(*d.outlen))) == NULL ||
+	    (d.crc = calloc(batch, sizeof(*d.crc))) == NULL ||
+	    (threads = calloc(jobs, sizeof(*threads))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < batch; i++)
+		if ((d.out[i] = malloc(d.cap)) == NULL)
+			err(1, NULL);
+
+	fwrite("\x1f\x8b\x08\x04", 1, 4, fp);	/* magic, deflate, FEXTRA */
+	put_int32(fp, 0);			/* mtime */
+	putc(0, fp);				/* xflags */
+	putc(3, fp);				/* OS, Unix */
+	put_int16(fp, 4 + 6 + 2 * nchunks);
+	putc('R', fp);
+	putc('A', fp);
+	put_int16(fp, 6 + 2 * nchunks);
+	put_int16(fp, 1);			/* version */
+	put_int16(fp, clen);
+	put_int16(fp, nchunks);
+	for (i = 0; i < nchunks; i++)
+		put_int16(fp, 0);
+
+	for (d.first = 0; d.first < nchunks; d.first += d.n) {
+		d.n = MIN(batch, nchunks - d.first);
+		d.next = 0;
+		n = MIN((size_t)jobs, d.n);
+		for (started = 1; (size_t)started < n; started++)
+			if (pthread_create(&threads[started], NULL,
+			    deflate_worker, &d) != 0)
+				break;
+		deflate_worker(&d);
+		for (i = 1; i < (size_t)started; i++)
+			pthread_join(threads[i], NULL);
+		if (d.error)
+			errx(1, "cannot compress chunks %zu to %zu", d.first,
+			    d.first + d.n - 1);
+
+		for (i = 0; i < d.n; i++) {
+			fwrite(d.out[i], 1, d.outlen[i], fp);
+			sizes[d.first + i] = d.outlen[i];
+			crc = crc32_combine(crc, d.crc[i],
+			    MIN(clen, len - (d.first + i) * clen));
+		}
+	}
+	put_int32(fp, crc);
+	put_int32(fp, len);
+
+	/* the chunk sizes follow the 10 byte header and 12 of the field */
+	if (fseek(fp, 22, SEEK_SET) == -1)
+		err(1, "%s", path);
+	for (i = 0; i < nchunks; i++)
+		put_int16(fp, sizes[i]);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+
+	for (i = 0; i < batch; i++)
+		free(d.out[i]);
+	free(threads);
+	free(d.crc);
+	free(d.outlen);
+	free(d.out);
+	free(sizes);
+}
+
+/*
+ * Check the new index like dict does and write its sidecars.
+ */
+static void
+finish_index(const char *path, off_t db_size, int sflag, uint32_t rate)
+{
+	const struct dc_strategy *st;
+	struct dc_index idx;
+	int fd;
+
+	memset(&idx, 0, sizeof(idx));
+	idx.path = path;
+	idx.writable = 1;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "%s", path);
+	if (index_open(fd, &idx) == -1)
+		err(1, "%s", path);
+	close(fd);
+	if (index_validate(&idx, db_size, jobs) == -1)
+		errx(1, "index '%s' failed validation", path);
+
+	if (sflag) {
+		if (index_table_write(&idx) == -1)
+			err(1, "%s line table", path);
+		for (st = index_strategies; st->name != NULL; st++)
+			if (st->open != NULL && st->open(&idx) == -1)
+				err(1, "%s %s index", path, st->name);
+	}
+	if (rate > 0 && index_bloom_write(&idx, rate) == -1)
+		err(1, "%s filter", path);
+	index_close(&idx);
+}
+
+static char *
+tmp_open(const char *path, FILE **fp)
+{
+	char *tmp;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1)
+		err(1, NULL);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "%s", tmp);
+	if (fchmod(fd, 0644) == -1 || (*fp = fdopen(fd, "w+")) == NULL)
+		err(1, "%s", tmp);
+	return tmp;
+}
+
+/*
+ * Write the sorted index lines, merging the runs if any were spilled.
+ */
+static void
+write_index(FILE *fp)
+{
+	struct source *srcs;
+	size_t i;
+
+	if (nruns == 0) {
+		sort_recs(fp, 0);
+		return;
+	}
+	if (nrecs > 0)
+		spill();
+	if ((srcs = calloc(nruns, sizeof(*srcs))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nruns; i++)
+		srcs[i].fp = runs[i];
+	merge(srcs, nruns, fp, 0);
+	for (i = 0; i < nruns; i++)
+		fclose(runs[i]);
+	free(srcs);
+}
+
+/*
+ * Write the index of the overlay.  Once a headword is deleted, a single
+ * line of length 0 is kept for it and only the entries added later.
+ */
+static void
+write_overlay(FILE *fp)
+{
+	struct rec *g, *r, *end = recs + nrecs, *del;
+
+	qsort(recs, nrecs, sizeof(*recs), rec_qsort_cmp);
+	for (g = recs; g < end; g = r) {
+		del = NULL;
+		for (r = g; r < end && r->wlen == g->wlen &&
+		    memcmp(pool + r->word, pool + g->word, g->wlen) == 0; r++)
+			if (r->len == 0)
+				del = r;
+		if (del != NULL) {
+			put_line(fp, pool + del->word, del);
+			g = del + 1;
+		}
+		for (; g < r; g++)
+			put_line(fp, pool + g->word, g);
+	}
+	if (ferror(fp))
+		err(1, "write");
+}
+
+/*
+ * Read the tab file and append the definitions to text from offset off.
+ * An empty definition deletes the headword from the dictionary if
+ * adding to the overlay.
+ */
+static void
+read_input(const char *path, FILE *text, uint64_t off)
+{
+	FILE *in;
+	char *line = NULL, *tab;
+	size_t linesize = 0, len;
+	uint64_t lineno = 0;
+	ssize_t linelen;
+
+	if (strcmp(path, "-") == 0)
+		in = stdin;
+	else if ((in = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	while ((linelen = getline(&line, &linesize, in)) != -1) {
+		lineno++;
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+		if ((tab = memchr(line, '\t', linelen)) == NULL)
+			errx(1, "%s:%llu: missing definition", path,
+			    (unsigned long long)lineno);
+		if (tab == line || tab - line > WORD_MAX)
+			errx(1, "%s:%llu: bad headword length", path,
+			    (unsigned long long)lineno);
+
+		if (overlay && tab + 1 == line + linelen)
+			len = 0;
+		else
+			len = put_entry(text, line, tab - line, tab + 1,
+			    line + linelen - tab - 1);
+		add_rec(line, tab - line, off, len, nseq++);
+		off += len;
+	}
+	if (ferror(in))
+		err(1, "%s", path);
+	if (in != stdin)
+		fclose(in);
+	free(line);
+}
+
+/*
+ * Iterate over all entries of the index with a prefix match of the
+ * empty word.
+ */
+static void
+iter_all(struct dc_index_iter *it, const struct dc_index *idx)
+{
+	static char empty[1];
+	const struct dc_strategy *prefix = index_strategy("prefix");
+	struct dc_query q;
+
+	index_query(&q, prefix, empty);
+	if (index_iter_begin(it, prefix, &q, idx) == -1)
+		err(1, "%s", idx->path);
+}
+
+/*
+ * Load the lines of the overlay index at path, if there is one.
+ */
+static void
+load_overlay(const char *path, off_t textlen)
+{
+	struct dc_index idx;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return;
+		err(1, "%s", path);
+	}
+	memset(&idx, 0, sizeof(idx));
+	idx.path = path;
+	if (index_open(fd, &idx) == -1)
+		err(1, "%s", path);
+	close(fd);
+	if (index_validate(&idx, textlen, 1) == -1)
+		errx(1, "index '%s' failed validation", path);
+
+	iter_all(&it, &idx);
+	while (index_iter_next(&it, &e) != NULL)
+		add_rec(e.match, e.match_len, e.def_off, e.def_len, nseq++);
+	index_iter_end(&it);
+	index_close(&idx);
+}
+
+/*
+ * Append the entries of the tab file to the overlay of name and write
+ * its index anew.  Definitions are only appended, so readers of the old
+ * index still find theirs.
+ */
+static void
+add_overlay(const char *input, const char *name)
+{
+	struct stat sb;
+	FILE *text, *fp;
+	char *idx_path, *text_path, *tmp;
+	int fd;
+
+	if (asprintf(&idx_path, "%s.delta.index", name) == -1 ||
+	    asprintf(&text_path, "%s.delta.dict", name) == -1)
+		err(1, NULL);
+	if ((fd = open(text_path, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1 ||
+	    fstat(fd, &sb) == -1 || (text = fdopen(fd, "a")) == NULL)
+		err(1, "%s", text_path);
+
+	load_overlay(idx_path, sb.st_size);
+	read_input(input, text, sb.st_size);
+	if (fclose(text) == EOF)
+		err(1, "%s", text_path);
+	if (nrecs == 0)
+		errx(1, "%s: no entries", input);
+
+	tmp = tmp_open(idx_path, &fp);
+	write_overlay(fp);
+	if (fclose(fp) == EOF)
+		err(1, "%s", tmp);
+	if (rename(tmp, idx_path) == -1)
+		err(1, "rename %s", idx_path);
+
+	free(tmp);
+	free(text_path);
+	free(idx_path);
+}
+
+static int
+put_piece(void *arg, const char *p, size_t len)
+{
+	return fwrite(p, 1, len, arg) == len ? 0 : -1;
+}
+
+/*
+ * Copy the definitions of the dictionary with its overlay to text, in
+ * the order of the merged index.  Return the suffix of the database.
+ */
+static const char *
+read_dictionary(const char *name, FILE *text)
+{
+	struct dc_database db;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_reader *r;
+	const char *def;
+	char *path;
+	uint64_t off = 0;
+	size_t i;
+	int fd = -1;
+
+	memset(&db, 0, sizeof(db));
+	for (i = 0; database_suffixes[i] != NULL; i++) {
+		if (asprintf(&path, "%s%s", name, database_suffixes[i]) == -1)
+			err(1, NULL);
+		if ((fd = open(path, O_RDONLY)) != -1 || errno != ENOENT)
+			break;
+		free(path);
+	}
+	if (database_suffixes[i] == NULL)
+		errx(1, "no database of '%s'", name);
+	if (fd == -1)
+		err(1, "%s", path);
+	if (database_open(fd, &db) == -1)
+		errx(1, "cannot open dictionary '%s'", path);
+	close(fd);
+	free(path);
+	if ((r = database_reader(&db, 1)) == NULL)
+		err(1, NULL);
+
+	if (asprintf(&path, "%s.index", name) == -1)
+		err(1, NULL);
+	db.index.path = path;
+	if ((fd = open(path, O_RDONLY)) == -1 ||
+	    index_open(fd, &db.index) == -1)
+		err(1, "%s", path);
+	close(fd);
+	if (index_validate(&db.index, db.size, jobs) == -1)
+		errx(1, "index '%s' failed validation", path);
+	if (index_delta_open(&db.index) == -1)
+		err(1, "overlay of %s", path);
+
+	iter_all(&it, &db.index);
+	while (index_iter_next(&it, &e) != NULL) {
+		if ((def = database_mapped(&db, &e)) != NULL) {
+			if (put_piece(text, def, e.def_len) == -1)
+				err(1, "write");
+		} else if (database_read_stream(r, &e, put_piece, text) == -1)
+			errx(1, "cannot read the definition of %.*s",
+			    e.match_len, e.match);
+		add_rec(e.match, e.match_len, off, e.def_len, nseq++);
+		off += e.def_len;
+	}
+	index_iter_end(&it);
+
+	database_reader_free(r);
+	index_close(&db.index);
+	database_close(&db);
+	free(path);
+	return database_suffixes[i];
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stat sb;
+	FILE *text, *fp;
+	const char *errstr, *name, *suffix = NULL;
+	char *idx_path, *db_path, *text_tmp, *tmp, *dz_tmp, *old;
+	u_char *map;
+	size_t clen = IDX_CHUNK, i;
+	uint32_t rate = 0;
+	int ch, level = Z_BEST_COMPRESSION, Cflag = 0, sflag = 0;
+
+	while ((ch = getopt(argc, argv, "aCc:F:j:l:m:s")) != -1) {
+		switch (ch) {
+		case 'a':
+			overlay = 1;
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'F':
+			rate = strtonum(optarg, 2, 65536, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate is %s: %s", errstr, optarg);
+			break;
+		case 'c':
+			clen = strtonum(optarg, 1024, UINT16_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "chunk size is %s: %s", errstr, optarg);
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			level = strtonum(optarg, 0, 9, &errstr);
+			if (errstr != NULL)
+				errx(1, "level is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			memory = strtonum(optarg, 1, 1024 * 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "memory is %s: %s", errstr, optarg);
+			memory *= 1024 * 1024;
+			break;
+		case 's':
+			sflag = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if ((overlay && Cflag) || argc != (Cflag ? 1 : 2))
+		usage();
+	name = argv[argc - 1];
+
+	if ((pool = malloc(memory)) == NULL)
+		err(1, NULL);
+	if (overlay) {
+		add_overlay(argv[0], name);
+		free(recs);
+		free(pool);
+		return 0;
+	}
+
+	if (asprintf(&idx_path, "%s.index", name) == -1 ||
+	    asprintf(&db_path, "%s.dict.dz", name) == -1)
+		err(1, NULL);
+
+	/* the plain text is compressed once all of it is there */
+	text_tmp = tmp_open(name, &text);
+	if (Cflag)
+		suffix = read_dictionary(name, text);
+	else
+		read_input(argv[0], text, 0);
+	if (nseq == 0)
+		errx(1, "%s: no entries", argv[0]);
+	if (fflush(text) == EOF)
+		err(1, "%s", text_tmp);
+
+	tmp = tmp_open(idx_path, &fp);
+	write_index(fp);
+	if (fclose(fp) == EOF)
+		err(1, "%s", tmp);
+	free(recs);
+	free(pool);
+
+	if (fstat(fileno(text), &sb) == -1)
+		err(1, "%s", text_tmp);
+	if (sb.st_size == 0)
+		errx(1, "%s: no definitions", argv[0]);
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(text), 0);
+	if (map == MAP_FAILED)
+		err(1, "%s", text_tmp);
+	dz_tmp = tmp_open(db_path, &fp);
+	write_dictzip(fp, dz_tmp, map, sb.st_size, clen, level);
+	munmap(map, sb.st_size);
+	fclose(text);
+	unlink(text_tmp);
+
+	if (rename(dz_tmp, db_path) == -1)
+		err(1, "rename %s", db_path);
+	/* a database in another format would be preferred to the new one */
+	if (suffix != NULL && strcmp(suffix, ".dict.dz") != 0) {
+		if (asprintf(&old, "%s%s", name, suffix) == -1)
+			err(1, NULL);
+		if (unlink(old) == -1)
+			err(1, "%s", old);
+		free(old);
+	}
+	if (rename(tmp, idx_path) == -1)
+		err(1, "rename %s", idx_path);
+	for (i = 0; Cflag && delta_files[i] != NULL; i++) {
+		if (asprintf(&old, "%s%s", name, delta_files[i]) == -1)
+			err(1, NULL);
+		if (unlink(old) == -1 && errno != ENOENT)
+			err(1, "%s", old);
+		free(old);
+	}
+	finish_index(idx_path, sb.st_size, sflag, rate);
+
+	free(dz_tmp);
+	free(tmp);
+	free(text_tmp);
+	free(db_path);
+	free(idx_path);
+	return 0;
+}
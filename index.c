@@ -17,269 +17,2057 @@
 #include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "dict.h"
 #include "index.h"
+#include "sidecar.h"
+
+#define TABLE_EXT	".bin"
+#define TABLE_MAGIC	"DCLT"
+#define TABLE_VERSION	2
+
+#define REV_EXT		".rev"
+#define REV_MAGIC	"DCRV"
+#define REV_VERSION	1
+
+#define SDX_EXT		".sdx"
+#define SDX_MAGIC	"DCSX"
+#define SDX_VERSION	1
+
+#define TRI_EXT		".tri"
+#define TRI_MAGIC	"DCTG"
+#define TRI_VERSION	1
+
+#define BLOOM_EXT	".bloom"
+#define BLOOM_MAGIC	"DCBF"
+#define BLOOM_VERSION	1
+#define BLOOM_BITS	512	/* per block, a cache line */
+#define BLOOM_K_MAX	16
+
+#define DELTA_INDEX	".delta.index"
+#define DELTA_TEXT	".delta.dict"
+
+#define HEAD_INDEX	0x01	/* heads of a merged iterator */
+#define HEAD_DELTA	0x02
+#define DONE_INDEX	0x04
+#define DONE_DELTA	0x08
+
+#define GALLOP_BYTES	256	/* first step without a line table */
+#define VALIDATE_PART	(4 * 1024 * 1024)	/* smallest part per thread */
+#define SCAN_PART	(1024 * 1024)
+
+int dc_stats_enabled;
+
+/* shared by all threads, relaxed atomics suffice for counting */
+static struct dc_stats index_counters;
+
+#define INDEX_COUNT(field, n) do {					\
+	if (dc_stats_enabled)						\
+		__atomic_fetch_add(&index_counters.field, (n),		\
+		    __ATOMIC_RELAXED);					\
+} while (0)
+
+#define _ -1
+static const signed char b64[256] = {
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, 62, _, _, _, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, _, _, _, _, _, _,
+	_, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, _, _, _, _, _,
+	_, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+};
+#undef _
 
 int
 index_open(int fd, struct dc_index *idx)
 {
 	struct stat sb;
+	void *data;
 
 	if (fstat(fd, &sb) == -1)
 		return -1;
-	idx->size = sb.st_size;
 
-	idx->data = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (idx->data == MAP_FAILED)
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
 		return -1;
 
+	idx->data = data;
+	idx->size = sb.st_size;
+	idx->mtime = sb.st_mtim;
 	return 0;
 }
 
-int
-index_validate(struct dc_index *idx, off_t db_size)
-{
-	off_t i;
-	int b64off_max = 0, b64len_max = 0, tabs = 0, b64chars = -1;
-	char c;
-
-	for (; db_size; db_size >>= 6)
-		b64off_max++;
-
-	for (i = LOOKUP_MAX; i; i >>= 6)
-		b64len_max++;
-
-	for (i = 0; i < idx->size; i++) {
-		c = idx->data[i];
-		if (c == '\t') {
-			if (tabs == 1 && b64chars > b64off_max)
-				return -1;
-			else if (tabs == 2 && b64chars > b64len_max)
-				return -1;
-			else if (b64chars == 0)
-				return -1;
-			tabs++;
-			b64chars = 0;
-			if (tabs > 2)
-				return -1;
-		} else if (c == '\n') {
-			if (tabs != 2)
-				return -1;
-			tabs = 0;
-		} else if (tabs) {
-			if ((c != '+' && c < '/') || (c > '9' && c < 'A')
-			    || (c > 'Z' && c < 'a') || (c > 'z')) {
-				return -1;
-			}
-			b64chars++;
-		}
+/*
+ * Return the first c1 or c2 in [p, end), or end.
+ */
+static const char *
+index_scan(const char *p, const char *end, char c1, char c2)
+{
+#if defined(__AVX2__)
+	const __m256i v1 = _mm256_set1_epi8(c1), v2 = _mm256_set1_epi8(c2);
+	__m256i x;
+	uint32_t m;
+
+	for (; end - p >= 32; p += 32) {
+		x = _mm256_loadu_si256((const __m256i *)p);
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_cmpeq_epi8(x, v1), _mm256_cmpeq_epi8(x, v2)));
+		if (m != 0)
+			return p + __builtin_ctz(m);
 	}
-	if (idx->data[idx->size - 1] != '\n')
-		return -1;
-	return 0;
+#elif defined(__SSE2__)
+	const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+	__m128i x;
+	uint32_t m;
+
+	for (; end - p >= 16; p += 16) {
+		x = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, v1),
+		    _mm_cmpeq_epi8(x, v2)));
+		if (m != 0)
+			return p + __builtin_ctz(m);
+	}
+#endif
+	while (p < end && *p != c1 && *p != c2) p++;
+
+	return p;
 }
 
+/*
+ * Return the number of base 64 characters at the start of [p, end).
+ */
 static size_t
-index_parse_b64(const char *data, size_t *res)
+index_b64_span(const char *p, const char *end)
 {
-	char c;
-	int i, l = 0;
-	*res = 0;
+	const char *s = p;
+#if defined(__SSE2__)
+	__m128i x, ok;
+	uint32_t m;
 
-	while (data[l + 1] != '\t' && data[l + 1] != '\n') l++;
+#define IN(x, lo, hi)	_mm_and_si128(_mm_cmpgt_epi8((x), _mm_set1_epi8((lo) - 1)), \
+			    _mm_cmplt_epi8((x), _mm_set1_epi8((hi) + 1)))
+	for (; end - p >= 16; p += 16) {
+		x = _mm_loadu_si128((const __m128i *)p);
+		ok = _mm_or_si128(_mm_or_si128(IN(x, 'A', 'Z'), IN(x, 'a', 'z')),
+		    _mm_or_si128(IN(x, '/', '9'),
+		    _mm_cmpeq_epi8(x, _mm_set1_epi8('+'))));
+		m = ~_mm_movemask_epi8(ok) & 0xffff;
+		if (m != 0)
+			return p - s + __builtin_ctz(m);
+	}
+#undef IN
+#endif
+	while (p < end && b64[(u_char)*p] != -1) p++;
+
+	return p - s;
+}
+
+static uint64_t
+index_b64_decode(const char *p, size_t len)
+{
+	uint64_t v = 0;
+
+	while (len-- > 0)
+		v = v << 6 | b64[(u_char)*p++];
+	return v;
+}
+
+struct index_part {
+	const char	*data;
+	const char	*p;
+	const char	*end;
+	size_t		 b64max;	/* digits of the database size */
+	uint64_t	 db_size;
+	struct dc_line	*lines;
+	size_t		 n;
+	int		 error;
+};
+
+/*
+ * Validate the lines in [p, end) and decode them into a line table.
+ * Every line is "headword HT offset HT length LF" with the offset and
+ * length in base 64 and within the database.
+ */
+static void *
+index_validate_part(void *arg)
+{
+	struct index_part *ip = arg;
+	struct dc_line *l, *nl;
+	const char *p = ip->p, *f;
+	size_t nmax = 0, len, mlen;
+	uint64_t off, dlen;
+
+	while (p < ip->end) {
+		f = index_scan(p, ip->end, '\t', '\n');
+		if (f == ip->end || *f != '\t')
+			goto fail;
+		mlen = f - p;
+
+		f++;
+		len = index_b64_span(f, ip->end);
+		if (len == 0 || len > ip->b64max || f + len == ip->end ||
+		    f[len] != '\t')
+			goto fail;
+		off = index_b64_decode(f, len);
+
+		f += len + 1;
+		len = index_b64_span(f, ip->end);
+		if (len == 0 || len > ip->b64max || f + len == ip->end ||
+		    f[len] != '\n')
+			goto fail;
+		dlen = index_b64_decode(f, len);
+		if (off > ip->db_size || dlen > ip->db_size - off)
+			goto fail;
 
-	for (i = 0; i < l; i++) {
-		c = data[l - i];
-		if (c == '+') {
-			c = 62;
-		} else if (c == '/') {
-			c = 63;
-		} else if (c >= '0' && c <= '9') {
-			c += 4;
-		} else if (c >= 'A' && c <= 'Z') {
-			c -= 65;
-		} else if (c >= 'a' && c <= 'z') {
-			c -= 71;
-		} else
-			errx(1, "not base 64");
+		if (ip->n == nmax) {
+			/* guess from the part size, lines rarely are shorter */
+			nmax = nmax ? nmax * 2 : (size_t)(ip->end - ip->p) / 16 + 1;
+			nl = reallocarray(ip->lines, nmax, sizeof(*nl));
+			if (nl == NULL)
+				goto fail;
+			ip->lines = nl;
+		}
+		l = &ip->lines[ip->n++];
+		l->off = p - ip->data;
+		l->def_off = off;
+		l->def_len = MIN(dlen, UINT32_MAX);
+		l->match_len = MIN(mlen, WORD_MAX);
+		l->pad = 0;
 
-		*res += c << (i * 6);
+		p = f + len + 1;
 	}
+	return NULL;
 
-	return l + 1;
+ fail:
+	ip->error = 1;
+	return NULL;
 }
 
-static struct dc_index_entry *
-index_parse_line(const char *line, struct dc_index_entry *e)
+/*
+ * Validate the index and build the line table in the same pass.  Large
+ * indexes are split at line boundaries into up to jobs parts, which are
+ * checked by threads of their own.
+ */
+int
+index_validate(struct dc_index *idx, off_t db_size, int jobs)
 {
-	const char *data;
-	size_t l = 0;
+	struct index_part *parts;
+	pthread_t *threads;
+	struct dc_line *lines;
+	const char *p, *end = idx->data + idx->size;
+	size_t n, b64max = 0;
+	off_t s;
+	int i, started, error = 0;
 
-	e->match = line;
+	if (idx->data[idx->size - 1] != '\n')
+		return -1;
+	DC_PROBE1(validate__start, idx->size);
 
-	while (line[l] != '\t') l++;
-	e->match_len = l;
-	data = line + l;
-	data += index_parse_b64(data, &e->def_off);
-	index_parse_b64(data, &e->def_len);
+	for (s = db_size; s; s >>= 6)
+		b64max++;
+	b64max = MAX(b64max, 1);	/* an empty overlay text has offset 0 */
 
-	if (e->match_len > WORD_MAX)
-		e->match_len = WORD_MAX;
-	if (e->def_len > LOOKUP_MAX)
-		e->def_len = LOOKUP_MAX;
+	jobs = MAX(1, MIN(jobs, idx->size / VALIDATE_PART));
+	if ((parts = calloc(jobs, sizeof(*parts))) == NULL ||
+	    (threads = calloc(jobs, sizeof(*threads))) == NULL) {
+		free(parts);
+		return -1;
+	}
 
-	return e;
+	for (p = idx->data, i = 0; i < jobs; i++) {
+		parts[i].data = idx->data;
+		parts[i].p = p;
+		parts[i].b64max = b64max;
+		parts[i].db_size = db_size;
+		if (i < jobs - 1)
+			p = MAX(p, idx->data + idx->size / jobs * (i + 1));
+		/*
+		 * The index ends in a newline, so one is found before end.
+		 * A long line may reach past the later split points, then
+		 * fewer parts are made.
+		 */
+		if (i == jobs - 1 || p == end)
+			p = end;
+		else
+			p = (const char *)memchr(p, '\n', end - p) + 1;
+		parts[i].end = p;
+		if (p == end)
+			jobs = i + 1;
+	}
+
+	for (started = 1; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL,
+		    index_validate_part, &parts[started]) != 0)
+			break;
+	index_validate_part(&parts[0]);
+	for (i = 1; i < jobs; i++) {
+		if (i < started)
+			pthread_join(threads[i], NULL);
+		else
+			index_validate_part(&parts[i]);
+	}
+
+	for (n = 0, i = 0; i < jobs; i++) {
+		error |= parts[i].error;
+		n += parts[i].n;
+	}
+
+	lines = NULL;
+	if (!error && idx->lines == NULL &&
+	    (lines = reallocarray(parts[0].lines, n, sizeof(*lines))) != NULL) {
+		parts[0].lines = NULL;
+		for (n = parts[0].n, i = 1; i < jobs; i++) {
+			memcpy(lines + n, parts[i].lines,
+			    parts[i].n * sizeof(*lines));
+			n += parts[i].n;
+		}
+		idx->lines = lines;
+		idx->nlines = n;
+	}
+
+	for (i = 0; i < jobs; i++)
+		free(parts[i].lines);
+	free(parts);
+	free(threads);
+
+	DC_PROBE2(validate__done, idx->nlines, error);
+	return error ? -1 : 0;
 }
 
+/*
+ * Decode the base 64 field at p, which must be terminated by delim.
+ * Return the first byte after the delimiter.
+ */
 static const char *
-index_prev(const char *cur, const struct dc_index *idx)
+index_parse_b64(const char *p, const char *end, char delim, size_t *res)
 {
-	const char *base = idx->data;
-	const char *p = cur;
+	size_t len;
 
-	if (p == base)
-		return NULL;
+	len = index_b64_span(p, end);
+	if (p + len == end || p[len] != delim)
+		errx(1, "not base 64");
+	*res = index_b64_decode(p, len);
 
-	p--;
-	while (p > base && p[-1] != '\n') p--;
+	return p + len + 1;
+}
 
-	return p;
+static struct dc_index_entry *
+index_parse_line(const struct dc_index *idx, const char *line,
+    struct dc_index_entry *e)
+{
+	const char *end = idx->data + idx->size, *p;
+
+	INDEX_COUNT(parsed, 1);
+	if ((p = memchr(line, '\t', end - line)) == NULL)
+		errx(1, "missing definition");
+	e->match = line;
+	e->match_len = MIN(p - line, WORD_MAX);
+	p = index_parse_b64(p + 1, end, '\t', &e->def_off);
+	index_parse_b64(p, end, '\n', &e->def_len);
+	e->def = NULL;
+
+	return e;
+}
+
+/*
+ * Return the start of the line containing cur, but not before lo.
+ */
+static const char *
+index_start(const char *cur, const char *lo)
+{
+	const char *p;
+
+	if ((p = memrchr(lo, '\n', cur - lo)) == NULL)
+		return lo;
+
+	return p + 1;
 }
 
 static const char *
 index_next(const char *cur, const struct dc_index *idx)
 {
 	const char *end = idx->data + idx->size;
-	const char *p = cur;
-
-	while (p < end && p[0] != '\n') p++;
-	p++;
+	const char *p;
 
-	if (p >= end)
+	if ((p = memchr(cur, '\n', end - cur)) == NULL || ++p >= end)
 		return NULL;
 
 	return p;
 }
 
 /*
- * key is NUL terminated
- * entry is HT terminated
+ * Compare the query to the headword of entry, which ends at the first
+ * HT.  The delimiter is found while comparing, in blocks of 16 bytes
+ * where possible, so each probe reads the headword only once.  Return
+ * the index of the first byte that differs or is the HT.
  */
+static size_t
+index_cmp(const struct dc_query *q, const char *entry, const char *end)
+{
+	const u_char *k = (const u_char *)q->word, *e = (const u_char *)entry;
+	size_t i = 0, n = MIN(q->len, (size_t)(end - entry));
+#if defined(__SSE2__)
+	const __m128i tab = _mm_set1_epi8('\t');
+	__m128i x, y;
+	uint32_t m;
+
+	for (; n - i >= 16; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(k + i));
+		y = _mm_loadu_si128((const __m128i *)(e + i));
+		m = (~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff) |
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(y, tab));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+#endif
+	while (i < n && k[i] == e[i] && e[i] != '\t') i++;
+
+	return i;
+}
+
 static int
-index_exact_cmp(const char *key, const char *entry)
+index_exact_cmp(const struct dc_query *q, const char *entry,
+    const char *end)
 {
-	size_t klen = strlen(key), elen = 0;
-	int r;
+	size_t i = index_cmp(q, entry, end);
 
-	while (entry[elen] != '\t') elen++;
-	r = strncmp(key, entry, MIN(klen, elen));
+	if (i < q->len) {
+		if (entry + i == end || entry[i] == '\t')
+			return 1;
+		return (u_char)q->word[i] - (u_char)entry[i];
+	}
+	if (entry + i < end && entry[i] == '\t')
+		return 0;
+	return -1;
+}
 
-	if (r == 0 && klen < elen)
-		return -1;
-	else if (r == 0 && elen < klen)
-		return 1;
-	return r;
+static int
+index_prefix_cmp(const struct dc_query *q, const char *entry,
+    const char *end)
+{
+	size_t i = index_cmp(q, entry, end);
+
+	if (i < q->len) {
+		if (entry + i == end || entry[i] == '\t')
+			return 1;
+		return (u_char)q->word[i] - (u_char)entry[i];
+	}
+	return 0;
+}
+
+static const char *
+index_line(const struct dc_index *idx, off_t pos)
+{
+	if (idx->lines != NULL)
+		return idx->data + idx->lines[pos].off;
+	return idx->data + pos;
 }
 
 /*
- * key is NUL terminated
- * entry is HT terminated
+ * Positions are line numbers if the line table is loaded and byte
+ * offsets of the line start in the index otherwise.  The position
+ * after the last line is index_end().
  */
-static int
-index_prefix_cmp(const char *key, const char *entry)
+static off_t
+index_end(const struct dc_index *idx)
 {
-	size_t klen = strlen(key), elen = 0;
-	int r;
+	if (idx->lines != NULL)
+		return idx->nlines;
+	return idx->size;
+}
 
-	while (entry[elen] != '\t') elen++;
-	r = strncmp(key, entry, MIN(klen, elen));
+static off_t
+index_pos_next(const struct dc_index *idx, off_t pos)
+{
+	const char *p;
 
-	if (r == 0 && elen < klen)
-		return 1;
-	return r;
+	if (idx->lines != NULL)
+		return pos + 1;
+	if ((p = index_next(idx->data + pos, idx)) == NULL)
+		return idx->size;
+	return p - idx->data;
 }
 
-static void *
-index_bsearch(const char *key, const struct dc_index *idx,
-    int (*compar)(const char *, const char *))
+/*
+ * Return the position of the line containing byte or line off, which
+ * lies in [lo, end).
+ */
+static off_t
+index_pos_at(const struct dc_index *idx, off_t lo, off_t off)
 {
-	const char *base = idx->data;
-	const char *end = idx->data + idx->size;
-	const char *p, *op = NULL;
-	size_t lim = idx->size / 2;
-	int cmp;
+	if (idx->lines != NULL)
+		return off;
+	return index_start(idx->data + off, idx->data + lo) - idx->data;
+}
 
-	while (lim != 0) {
-		p = base + lim;
-		if (p > end)
-			p = end;
+static struct dc_index_entry *
+index_entry(const struct dc_index *idx, off_t pos, struct dc_index_entry *e)
+{
+	const struct dc_line *l;
+
+	if (idx->lines == NULL)
+		return index_parse_line(idx, idx->data + pos, e);
+
+	l = &idx->lines[pos];
+	e->match = idx->data + l->off;
+	e->match_len = l->match_len;
+	e->def_off = l->def_off;
+	e->def_len = l->def_len;
+	e->def = NULL;
+	return e;
+}
+
+static int
+index_probe(const struct dc_index *idx, off_t pos, const struct dc_query *q,
+    int (*compar)(const struct dc_query *, const char *, const char *))
+{
+	INDEX_COUNT(compares, 1);
+	return (*compar)(q, index_line(idx, pos), idx->data + idx->size);
+}
+
+/*
+ * Return the first position in [lo, hi) whose line does not sort before
+ * key, or hi if there is none.
+ */
+static off_t
+index_bsearch(const struct dc_query *key, const struct dc_index *idx,
+    off_t lo, off_t hi,
+    int (*compar)(const struct dc_query *, const char *, const char *))
+{
+	off_t p;
+	uint64_t probes = 0;
+
+	while (lo < hi) {
+		p = index_pos_at(idx, lo, lo + (hi - lo) / 2);
+		probes++;
+		if (index_probe(idx, p, key, compar) > 0)	/* move right */
+			lo = index_pos_next(idx, p);
+		else						/* move left */
+			hi = p;
+	}
+	INDEX_COUNT(probes, probes);
+	DC_PROBE2(bsearch, probes, lo);
+	return lo;
+}
+
+/*
+ * Like index_bsearch() from lo to the end, but probe exponentially
+ * growing steps first.  Cheap if the result is close to lo.
+ */
+static off_t
+index_gallop(const struct dc_query *key, const struct dc_index *idx,
+    off_t lo,
+    int (*compar)(const struct dc_query *, const char *, const char *))
+{
+	off_t end = index_end(idx), hi = end, p;
+	off_t step = idx->lines != NULL ? 1 : GALLOP_BYTES;
 
-		p = index_prev(p, idx);
-		if (p == op)
+	while (end - lo > step) {
+		p = index_pos_at(idx, lo, lo + step);
+		INDEX_COUNT(probes, 1);
+		if (index_probe(idx, p, key, compar) <= 0) {
+			hi = p;
 			break;
-		op = p;
-
-		cmp = (*compar)(key, p);
-		if (cmp == 0)
-			return ((void *)p);
-		if (cmp > 0) {	/* key > p: move right */
-			base = index_next(p, idx);
-			if (base == NULL)
-				base = p;
-			lim = (end - p) / 2;
-		} else {	/* else move left */
-			end = p;
-			lim = (p - base) / 2;
 		}
+		lo = index_pos_next(idx, p);
+		step *= 2;
+	}
+	return index_bsearch(key, idx, lo, hi, compar);
+}
+
+/*
+ * Hash of a headword for the filter, 8 bytes at a time.
+ */
+static uint64_t
+index_hash(const char *word, size_t len)
+{
+	const uint64_t m = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * m, w;
+
+	for (; len >= 8; word += 8, len -= 8) {
+		memcpy(&w, word, 8);
+		h = (h ^ w) * m;
+		h ^= h >> 29;
 	}
-	return (NULL);
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, word, len);
+		h = (h ^ w) * m;
+	}
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * The high half of the hash picks the block, the low half the k bits
+ * in it by double hashing.
+ */
+static void
+index_bloom_bits(const struct dc_bloom *b, uint64_t h, size_t *block,
+    uint32_t *bits)
+{
+	uint32_t x = h, step = (x >> 9) | 1;
+	uint32_t i;
+
+	*block = ((h >> 32) * b->nblocks) >> 32;
+	for (i = 0; i < b->k; i++, x += step)
+		bits[i] = x % BLOOM_BITS;
+}
+
+/*
+ * An exact query for a headword the filter has not seen matches
+ * nothing, so its search can be skipped.
+ */
+static int
+index_bloom_miss(const struct dc_strategy *strat, const struct dc_query *q,
+    const struct dc_index *idx)
+{
+	const struct dc_bloom *b = idx->bloom;
+	const uint64_t *blk;
+	uint32_t bits[BLOOM_K_MAX];
+	size_t block;
+	uint32_t i;
+
+	if (b == NULL || strat->compar != index_exact_cmp ||
+	    strat->key != NULL)
+		return 0;
+	index_bloom_bits(b, index_hash(q->word, q->len), &block, bits);
+	blk = b->blocks + block * (BLOOM_BITS / 64);
+	for (i = 0; i < b->k; i++)
+		if ((blk[bits[i] / 64] & (1ULL << (bits[i] % 64))) == 0) {
+			INDEX_COUNT(filtered, 1);
+			return 1;
+		}
+	return 0;
+}
+
+static const struct dc_index *
+index_view(const struct dc_strategy *strat, const struct dc_index *idx)
+{
+	if (strat->view == NULL)
+		return idx;
+	return strat->view(idx);
 }
 
 static int
-index_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *list, int (*compar)(const char *, const char *))
+index_iter_match(const struct dc_index_iter *it)
 {
-	const char *p;
-	struct dc_index_entry *e = SLIST_FIRST(list);
-	int r = 0;
+	return it->pos < index_end(it->view) &&
+	    index_probe(it->view, it->pos, &it->key, it->compar) == 0;
+}
 
-	if ((p = index_bsearch(req, idx, compar)) == NULL)
-		return r;
-	while (p && compar(req, p) == 0) {
-		p = index_prev(p, idx);
+/*
+ * Locate the first line for each of n ascending words in a single walk
+ * over the index, each search starts at the result of the previous one.
+ */
+void
+index_locate(const struct dc_strategy *strat, const struct dc_query *qs,
+    size_t n, const struct dc_index *idx, off_t *pos)
+{
+	const struct dc_index *view;
+	off_t lo = 0;
+	size_t i;
+
+	if ((view = index_view(strat, idx)) == NULL) {
+		memset(pos, 0, n * sizeof(*pos));
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (index_bloom_miss(strat, &qs[i], idx))
+			pos[i] = -1;
+		else
+			lo = pos[i] = index_gallop(&qs[i], view, lo,
+			    strat->compar);
+	}
+}
+
+/*
+ * Start iterating over the lines matching req from pos, as returned by
+ * index_locate().  Nothing matches at pos -1, or if the strategy needs a
+ * derived index that could not be opened.  Every iterator is released with
+ * index_iter_end().
+ */
+int
+index_iter_at(struct dc_index_iter *it, const struct dc_strategy *strat,
+    const struct dc_query *req, off_t pos, const struct dc_index *idx)
+{
+	it->idx = idx;
+	it->view = index_view(strat, idx);
+	it->key = *req;
+	it->compar = strat->compar;
+	it->next = strat->next;
+	it->pos = pos;
+	it->left = it->view != NULL ? SIZE_MAX : 0;
+	if (pos == -1) {
+		it->pos = it->view != NULL ? index_end(it->view) : 0;
+		it->left = 0;
+	}
+	it->found = NULL;
+	it->delta = NULL;
+	it->order = strat->key;
+	if (strat->begin != NULL && strat->begin(it) == -1)
+		return -1;
+
+	/* the overlay is searched alongside and merged */
+	if (idx->delta != NULL) {
+		if ((it->delta = malloc(sizeof(*it->delta))) == NULL)
+			return -1;
+		if (index_iter_begin(it->delta, strat, req, idx->delta) == -1)
+			return -1;
+		it->heads = 0;
+		it->merged_left = SIZE_MAX;
+	}
+	return 0;
+}
+
+int
+index_iter_begin(struct dc_index_iter *it, const struct dc_strategy *strat,
+    const struct dc_query *req, const struct dc_index *idx)
+{
+	const struct dc_index *view;
+	off_t pos = 0;
+
+	if (index_bloom_miss(strat, req, idx))
+		pos = -1;
+	else if (strat->compar != NULL &&
+	    (view = index_view(strat, idx)) != NULL)
+		pos = index_bsearch(req, view, 0, index_end(view),
+		    strat->compar);
+	return index_iter_at(it, strat, req, pos, idx);
+}
+
+/*
+ * Skip the first offset matches and stop after limit more, if limit is
+ * not 0.  Skipping is constant time with a line table.
+ */
+void
+index_iter_page(struct dc_index_iter *it, size_t offset, size_t limit)
+{
+	const struct dc_index *view = it->view;
+	struct dc_index_entry e;
+	off_t last;
+
+	if (it->delta != NULL) {
+		it->merged_left = SIZE_MAX;
+		for (; offset > 0 && index_iter_next(it, &e) != NULL; offset--)
+			;
+		it->merged_left = limit == 0 ? SIZE_MAX : limit;
+		return;
+	}
+	if (view == NULL)
+		return;
+
+	if (it->next != NULL) {
+		it->left = SIZE_MAX;
+		for (; offset > 0 && it->next(it, &e) != NULL; offset--)
+			;
+	} else if (view->lines != NULL && offset > 0) {
+		last = it->pos + offset - 1;
+		if (offset <= view->nlines && last < index_end(view) &&
+		    index_probe(view, last, &it->key, it->compar) == 0)
+			it->pos = last + 1;
+		else
+			it->pos = index_end(view);
+	} else {
+		for (; offset > 0 && index_iter_match(it); offset--)
+			it->pos = index_pos_next(view, it->pos);
 	}
 
-	if (p == NULL)
-		p = idx->data;
+	it->left = limit == 0 ? SIZE_MAX : limit;
+}
+
+static struct dc_index_entry *
+index_iter_step(struct dc_index_iter *it, struct dc_index_entry *e)
+{
+	const struct dc_index *idx = it->idx, *view = it->view;
+
+	if (it->next != NULL)
+		return it->left == 0 ? NULL : it->next(it, e);
+	if (it->left == 0 || !index_iter_match(it))
+		return NULL;
+
+	if (view == idx)
+		index_entry(idx, it->pos, e);
 	else
-		p = index_next(p, idx);
+		index_parse_line(idx, idx->data + view->src[it->pos], e);
+	it->pos = index_pos_next(view, it->pos);
+	it->left--;
+	return e;
+}
+
+/*
+ * Return if the overlay deletes the entries of the headword of e.
+ */
+static int
+index_deleted(const struct dc_index *delta, const struct dc_index_entry *e)
+{
+	struct dc_index_entry d;
+	struct dc_query q;
+	off_t pos, end = index_end(delta);
+
+	q.word = e->match;
+	q.len = e->match_len;
+	pos = index_bsearch(&q, delta, 0, end, index_exact_cmp);
+	for (; pos < end && index_probe(delta, pos, &q, index_exact_cmp) == 0;
+	    pos = index_pos_next(delta, pos))
+		if (index_entry(delta, pos, &d)->def_len == 0)
+			return 1;
+	return 0;
+}
+
+static int
+index_word_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int r;
+
+	if ((r = memcmp(a, b, MIN(alen, blen))) != 0)
+		return r;
+	return (alen > blen) - (alen < blen);
+}
+
+/*
+ * Compare the headwords of two entries in the order of the view, by
+ * their keys first if it is a derived index.
+ */
+static int
+index_entry_cmp(const struct dc_index_iter *it, const struct dc_index_entry *a,
+    const struct dc_index_entry *b)
+{
+	char ka[WORD_MAX], kb[WORD_MAX];
+	size_t alen, blen;
+	int r;
 
-	while (p && compar(req, p) == 0) {
-		e = SLIST_NEXT(index_parse_line(p, e), entries);
-		r++;
-		if (e == NULL)
+	if (it->order != NULL) {
+		memcpy(ka, a->match, a->match_len);
+		memcpy(kb, b->match, b->match_len);
+		alen = it->order(ka, a->match_len);
+		blen = it->order(kb, b->match_len);
+		if ((r = index_word_cmp(ka, alen, kb, blen)) != 0)
 			return r;
-		p = index_next(p, idx);
+	}
+	return index_word_cmp(a->match, a->match_len, b->match, b->match_len);
+}
+
+/*
+ * Merge the matches of the index, without those the overlay deletes,
+ * with the entries the overlay adds.  Both are in the order of the
+ * headwords, the index goes first for equal ones.
+ */
+static struct dc_index_entry *
+index_merge_next(struct dc_index_iter *it, struct dc_index_entry *e)
+{
+	const struct dc_index *delta = it->idx->delta;
+	struct dc_index_entry *h;
+
+	if (it->merged_left == 0)
+		return NULL;
+	while ((it->heads & (HEAD_INDEX | DONE_INDEX)) == 0) {
+		if (index_iter_step(it, &it->head[0]) == NULL)
+			it->heads |= DONE_INDEX;
+		else if (!index_deleted(delta, &it->head[0]))
+			it->heads |= HEAD_INDEX;
+	}
+	while ((it->heads & (HEAD_DELTA | DONE_DELTA)) == 0) {
+		if (index_iter_step(it->delta, &it->head[1]) == NULL)
+			it->heads |= DONE_DELTA;
+		else if (it->head[1].def_len > 0)
+			it->heads |= HEAD_DELTA;
 	}
 
-	return r;
+	if ((it->heads & HEAD_INDEX) && ((it->heads & HEAD_DELTA) == 0 ||
+	    index_entry_cmp(it, &it->head[0], &it->head[1]) <= 0)) {
+		h = &it->head[0];
+		it->heads &= ~HEAD_INDEX;
+	} else if (it->heads & HEAD_DELTA) {
+		h = &it->head[1];
+		h->def = delta->text + h->def_off;
+		it->heads &= ~HEAD_DELTA;
+	} else
+		return NULL;
+
+	*e = *h;
+	it->merged_left--;
+	return e;
 }
 
-int
-index_prefix_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *list)
+struct dc_index_entry *
+index_iter_next(struct dc_index_iter *it, struct dc_index_entry *e)
 {
-	return index_find(req, idx, list, index_prefix_cmp);
+	if (it->delta != NULL)
+		return index_merge_next(it, e);
+	return index_iter_step(it, e);
 }
 
-int
-index_exact_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *list)
+void
+index_iter_end(struct dc_index_iter *it)
+{
+	free(it->found);
+	it->found = NULL;
+	if (it->delta != NULL) {
+		index_iter_end(it->delta);
+		free(it->delta);
+		it->delta = NULL;
+	}
+}
+
+/*
+ * Lower case word in place and turn it into the search key of strat.
+ * Remember its length for the comparators.
+ */
+void
+index_query(struct dc_query *q, const struct dc_strategy *strat, char *word)
+{
+	char *p;
+
+	for (p = word; *p != '\0'; p++)
+		*p = tolower((u_char)*p);
+	q->word = word;
+	q->len = p - word;
+	q->dist = 1;
+	q->jobs = 1;
+	if (strat->key != NULL)
+		q->len = strat->key(word, q->len);
+}
+
+struct index_key {
+	const char	*key;
+	size_t		 len;
+	uint64_t	 src;
+};
+
+static int
+index_key_cmp(const void *a, const void *b)
+{
+	const struct index_key *ka = a, *kb = b;
+	int r;
+
+	if ((r = memcmp(ka->key, kb->key, MIN(ka->len, kb->len))) != 0)
+		return r;
+	if (ka->len != kb->len)
+		return ka->len < kb->len ? -1 : 1;
+	return ka->src < kb->src ? -1 : ka->src > kb->src;
+}
+
+/*
+ * Map a derived index written by index_derived_build().  It holds the
+ * source offsets, the line table and the HT terminated keys.
+ */
+static int
+index_derived_map(struct dc_index *d, const struct dc_index *idx,
+    const char *ext, const char *magic, uint32_t version)
+{
+	struct dc_sidecar *sc = &d->table;
+	size_t n;
+
+	if (sidecar_open(sc, idx, ext, magic, version) == -1)
+		return -1;
+
+	n = sc->count;
+	if (sc->len < n * (sizeof(*d->src) + sizeof(*d->lines)))
+		goto fail;
+	d->src = sc->data;
+	d->lines = (const struct dc_line *)(d->src + n);
+	d->nlines = n;
+	d->data = (const char *)(d->lines + n);
+	d->size = sc->len - n * (sizeof(*d->src) + sizeof(*d->lines));
+	if (n > 0 && (d->lines[n - 1].off >= (uint64_t)d->size ||
+	    d->src[n - 1] >= (uint64_t)idx->size))
+		goto fail;
+	if (d->size > 0 && d->data[d->size - 1] != '\t')
+		goto fail;
+	return 0;
+
+ fail:
+	sidecar_close(sc);
+	return -1;
+}
+
+/*
+ * Compute the key of every headword, sort them and write the result to
+ * the sidecar.  If that fails, the derived index is kept in memory.
+ */
+static int
+index_derived_build(struct dc_index *d, const struct dc_index *idx,
+    const char *ext, const char *magic, uint32_t version,
+    size_t (*key)(char *, size_t))
+{
+	struct index_key *keys;
+	struct dc_line *lines;
+	struct iovec iov[3];
+	uint64_t *src;
+	const char *p, *t, *nl, *end = idx->data + idx->size;
+	char *pool;
+	size_t i, n = 0, nmax = 0, len = 0;
+
+	/* keys are never longer than their headword and its HT */
+	if ((pool = malloc(idx->size)) == NULL)
+		return -1;
+	keys = NULL;
+	for (p = idx->data; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			break;
+		if ((t = memchr(p, '\t', nl - p)) == NULL)
+			goto fail;
+		if (n == nmax) {
+			nmax = nmax ? nmax * 2 : 1024;
+			if ((keys = reallocarray(keys, nmax,
+			    sizeof(*keys))) == NULL)
+				goto fail;
+		}
+		memcpy(pool + len, p, t - p);
+		keys[n].key = pool + len;
+		keys[n].len = key(pool + len, t - p);
+		keys[n].src = p - idx->data;
+		len += keys[n].len;
+		pool[len++] = '\t';
+		n++;
+	}
+
+	qsort(keys, n, sizeof(*keys), index_key_cmp);
+
+	if ((src = calloc(n + 1, sizeof(*src))) == NULL ||
+	    (lines = calloc(n + 1, sizeof(*lines))) == NULL) {
+		free(src);
+		goto fail;
+	}
+	for (i = 0; i < n; i++) {
+		src[i] = keys[i].src;
+		lines[i].off = keys[i].key - pool;
+		lines[i].match_len = MIN(keys[i].len, WORD_MAX);
+	}
+	free(keys);
+
+	iov[0].iov_base = src;
+	iov[0].iov_len = n * sizeof(*src);
+	iov[1].iov_base = lines;
+	iov[1].iov_len = n * sizeof(*lines);
+	iov[2].iov_base = pool;
+	iov[2].iov_len = len;
+	if (sidecar_write(idx, ext, magic, version, n, iov, 3) == 0 &&
+	    index_derived_map(d, idx, ext, magic, version) == 0) {
+		free(src);
+		free(lines);
+		free(pool);
+		return 0;
+	}
+
+	d->src = src;
+	d->lines = lines;
+	d->nlines = n;
+	d->data = pool;
+	d->size = len;
+	return 0;
+
+ fail:
+	free(keys);
+	free(pool);
+	return -1;
+}
+
+static int
+index_derived_open(struct dc_index *idx, struct dc_index **dp,
+    const char *ext, const char *magic, uint32_t version,
+    size_t (*key)(char *, size_t))
+{
+	struct dc_index *d;
+
+	if (*dp != NULL)
+		return 0;
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return -1;
+	if (index_derived_map(d, idx, ext, magic, version) == -1 &&
+	    index_derived_build(d, idx, ext, magic, version, key) == -1) {
+		free(d);
+		return -1;
+	}
+	*dp = d;
+	return 0;
+}
+
+/*
+ * Suffixes are prefixes of the reversed headwords.  Multibyte
+ * characters are reversed bytewise, like the query, so they still match.
+ */
+static size_t
+index_reverse(char *word, size_t len)
+{
+	char c, *p = word, *q = word + len;
+
+	while (p < q && p < --q) {
+		c = *p;
+		*p++ = *q;
+		*q = c;
+	}
+	return len;
+}
+
+static int
+index_rev_open(struct dc_index *idx)
+{
+	if (idx->delta != NULL && index_rev_open(idx->delta) == -1)
+		return -1;
+	return index_derived_open(idx, &idx->rev, REV_EXT, REV_MAGIC,
+	    REV_VERSION, index_reverse);
+}
+
+static const struct dc_index *
+index_rev(const struct dc_index *idx)
+{
+	return idx->rev;
+}
+
+/*
+ * Order lines after all lines starting with the query.
+ */
+static int
+index_after_cmp(const struct dc_query *q, const char *entry, const char *end)
+{
+	return index_prefix_cmp(q, entry, end) >= 0 ? 1 : -1;
+}
+
+static int
+index_fuzzy_begin(struct dc_index_iter *it)
+{
+	size_t j;
+
+	it->fuzzy.word = NULL;
+	it->fuzzy.depth = 0;
+	for (j = 0; j <= MIN(it->key.len, FUZZY_WORD); j++)
+		it->fuzzy.rows[0][j] = j;
+	return 0;
+}
+
+/*
+ * Replace word by its Soundex code: the first letter followed by up to
+ * three digits for the consonants after it.  The code is not padded
+ * with zeros, so it never gets longer than the word.
+ */
+static size_t
+index_soundex(char *word, size_t len)
+{
+	static const char code[] = "01230120022455012623010202";
+	size_t i, n = 0;
+	char c, d, last = 0;
+
+	for (i = 0; i < len && n < 4; i++) {
+		c = tolower((u_char)word[i]);
+		if (c < 'a' || c > 'z')
+			continue;
+		d = code[c - 'a'];
+		if (n == 0)
+			word[n++] = c;
+		else if (d != '0' && d != last)
+			word[n++] = d;
+		if (c != 'h' && c != 'w')
+			last = d;
+	}
+	return n;
+}
+
+static int
+index_sdx_open(struct dc_index *idx)
+{
+	if (idx->delta != NULL && index_sdx_open(idx->delta) == -1)
+		return -1;
+	return index_derived_open(idx, &idx->sdx, SDX_EXT, SDX_MAGIC,
+	    SDX_VERSION, index_soundex);
+}
+
+static const struct dc_index *
+index_sdx(const struct dc_index *idx)
+{
+	return idx->sdx;
+}
+
+/*
+ * The sorted index is walked like a trie.  Headwords sharing a prefix
+ * are adjacent, so the rows of the edit distance table for the prefix
+ * are computed once for all of them.  Once every distance in a row is
+ * too large, all lines with that prefix are skipped with one gallop.
+ * Distances are counted in bytes.
+ */
+static struct dc_index_entry *
+index_fuzzy_next(struct dc_index_iter *it, struct dc_index_entry *e)
+{
+	struct dc_fuzzy *fz = &it->fuzzy;
+	const struct dc_index *idx = it->idx;
+	const char *w, *t, *end = idx->data + idx->size;
+	const char *q = it->key.word;
+	struct dc_query pre;
+	size_t qlen = it->key.len, dist = it->key.dist, wlen, lim, i, j;
+	uint8_t *r, *p, min;
+	off_t pos;
+
+	if (qlen > FUZZY_WORD || dist > FUZZY_DIST)
+		return NULL;
+
+	while (it->pos < index_end(idx)) {
+		w = index_line(idx, it->pos);
+		if ((t = memchr(w, '\t', end - w)) == NULL)
+			return NULL;
+		wlen = t - w;
+
+		/* rows for the prefix shared with the last word are kept */
+		for (i = 0; i < fz->depth && i < wlen && fz->word[i] == w[i];
+		    i++)
+			;
+		lim = MIN(wlen, qlen + dist + 1);
+		for (i++, min = 0; i <= lim && min <= dist; i++) {
+			p = fz->rows[i - 1];
+			r = fz->rows[i];
+			r[0] = min = i;
+			for (j = 1; j <= qlen; j++) {
+				r[j] = MIN(MIN(p[j], r[j - 1]) + 1,
+				    p[j - 1] + (w[i - 1] != q[j - 1]));
+				min = MIN(min, r[j]);
+			}
+		}
+		fz->word = w;
+		fz->depth = i - 1;
+
+		if (min > dist) {
+			pre.word = w;
+			pre.len = i - 1;
+			it->pos = index_gallop(&pre, idx, it->pos,
+			    index_after_cmp);
+			continue;
+		}
+
+		pos = it->pos;
+		it->pos = index_pos_next(idx, pos);
+		if (fz->rows[wlen][qlen] <= dist) {
+			it->left--;
+			return index_entry(idx, pos, e);
+		}
+	}
+	return NULL;
+}
+
+#define GRAM(p)	((uint32_t)(u_char)(p)[0] << 16 | \
+		    (uint32_t)(u_char)(p)[1] << 8 | (u_char)(p)[2])
+
+static int
+index_gram_cmp(const void *a, const void *b)
+{
+	const struct dc_gram *ga = a, *gb = b;
+
+	return ga->gram < gb->gram ? -1 : ga->gram > gb->gram;
+}
+
+static int
+index_tri_map(struct dc_trigrams *tri, const struct dc_index *idx)
+{
+	struct dc_sidecar *sc = &tri->sc;
+	const struct dc_gram *g;
+	size_t n, dlen, i;
+
+	if (sidecar_open(sc, idx, TRI_EXT, TRI_MAGIC, TRI_VERSION) == -1)
+		return -1;
+
+	n = sc->count;
+	if (n > sc->len / sizeof(*tri->grams))
+		goto fail;
+	dlen = n * sizeof(*tri->grams);
+	if ((sc->len - dlen) % sizeof(*tri->post) != 0)
+		goto fail;
+	tri->grams = sc->data;
+	tri->ngrams = n;
+	tri->post = (const uint32_t *)(tri->grams + n);
+	tri->npost = (sc->len - dlen) / sizeof(*tri->post);
+
+	/* searched by gram, every posting list and line must be there */
+	for (i = 0; i < n; i++) {
+		g = &tri->grams[i];
+		if ((i > 0 && g->gram <= g[-1].gram) ||
+		    g->start > tri->npost || g->count > tri->npost - g->start)
+			goto fail;
+	}
+	for (i = 0; i < tri->npost; i++)
+		if (tri->post[i] >= (uint64_t)idx->size ||
+		    (tri->post[i] > 0 && idx->data[tri->post[i] - 1] != '\n'))
+			goto fail;
+	return 0;
+
+ fail:
+	sidecar_close(sc);
+	return -1;
+}
+
+/*
+ * Sort keys of gram << 32 | line offset by their gram.  The keys are
+ * made in index order and the sort is stable, so every posting list
+ * ends up ascending.
+ */
+static int
+index_tri_sort(uint64_t *keys, size_t n)
+{
+	uint64_t *tmp, *from = keys, *to;
+	size_t count[256], sum, c, i;
+	int shift;
+
+	if ((tmp = reallocarray(NULL, n, sizeof(*tmp))) == NULL)
+		return -1;
+	for (shift = 32, to = tmp; shift < 56; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[from[i] >> shift & 0xff]++;
+		for (sum = 0, i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			to[count[from[i] >> shift & 0xff]++] = from[i];
+		to = from;
+		from = from == keys ? tmp : keys;
+	}
+	memcpy(keys, from, n * sizeof(*keys));
+	free(tmp);
+	return 0;
+}
+
+static int
+index_tri_build(struct dc_trigrams *tri, const struct dc_index *idx)
+{
+	struct dc_gram *grams = NULL;
+	struct iovec iov[2];
+	uint32_t *post = NULL;
+	uint64_t *keys;
+	const char *p, *t, *nl, *w, *end = idx->data + idx->size;
+	size_t i, n = 0, ng = 0, np = 0;
+
+	if ((uint64_t)idx->size > UINT32_MAX)
+		return -1;
+	/* count the trigrams first, a headword of len bytes has len - 2 */
+	for (p = idx->data; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			break;
+		if ((t = memchr(p, '\t', nl - p)) == NULL)
+			return -1;
+		if (t - p > 2)
+			n += t - p - 2;
+	}
+	if ((keys = reallocarray(NULL, n + 1, sizeof(*keys))) == NULL)
+		return -1;
+	for (n = 0, p = idx->data; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			break;
+		t = memchr(p, '\t', nl - p);
+		for (w = p; w + 3 <= t; w++)
+			keys[n++] = (uint64_t)GRAM(w) << 32 | (p - idx->data);
+	}
+	if (index_tri_sort(keys, n) == -1)
+		goto fail;
+
+	if ((grams = calloc(n + 1, sizeof(*grams))) == NULL ||
+	    (post = calloc(n + 1, sizeof(*post))) == NULL)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		if (i > 0 && keys[i] == keys[i - 1])
+			continue;
+		if (ng == 0 || grams[ng - 1].gram != keys[i] >> 32) {
+			grams[ng].gram = keys[i] >> 32;
+			grams[ng].start = np;
+			ng++;
+		}
+		grams[ng - 1].count++;
+		post[np++] = (uint32_t)keys[i];
+	}
+	free(keys);
+
+	iov[0].iov_base = grams;
+	iov[0].iov_len = ng * sizeof(*grams);
+	iov[1].iov_base = post;
+	iov[1].iov_len = np * sizeof(*post);
+	if (sidecar_write(idx, TRI_EXT, TRI_MAGIC, TRI_VERSION, ng, iov,
+	    2) == 0 && index_tri_map(tri, idx) == 0) {
+		free(grams);
+		free(post);
+		return 0;
+	}
+
+	tri->grams = grams;
+	tri->ngrams = ng;
+	tri->post = post;
+	tri->npost = np;
+	return 0;
+
+ fail:
+	free(keys);
+	free(grams);
+	free(post);
+	return -1;
+}
+
+static int
+index_tri_open(struct dc_index *idx)
+{
+	struct dc_trigrams *tri;
+
+	if (idx->delta != NULL && index_tri_open(idx->delta) == -1)
+		return -1;
+	if (idx->tri != NULL)
+		return 0;
+	if ((tri = calloc(1, sizeof(*tri))) == NULL)
+		return -1;
+	if (index_tri_map(tri, idx) == -1 &&
+	    index_tri_build(tri, idx) == -1) {
+		free(tri);
+		return -1;
+	}
+	idx->tri = tri;
+	return 0;
+}
+
+/*
+ * Candidates are the lines on the shortest posting list among the
+ * trigrams of the query.  Without trigrams, every line is one.
+ */
+static int
+index_substr_begin(struct dc_index_iter *it)
+{
+	const struct dc_trigrams *tri = it->idx->tri;
+	const struct dc_gram *g, *best = NULL;
+	struct dc_gram key;
+	const char *q = it->key.word;
+	size_t i;
+
+	it->cand = it->cand_end = NULL;
+	if (tri == NULL || it->key.len < 3)
+		return 0;
+
+	for (i = 0; i + 3 <= it->key.len; i++) {
+		key.gram = GRAM(q + i);
+		g = bsearch(&key, tri->grams, tri->ngrams, sizeof(*g),
+		    index_gram_cmp);
+		if (g == NULL) {
+			it->cand = it->cand_end = tri->post;
+			return 0;
+		}
+		if (best == NULL || g->count < best->count)
+			best = g;
+	}
+	it->cand = tri->post + best->start;
+	it->cand_end = it->cand + best->count;
+	return 0;
+}
+
+static struct dc_index_entry *
+index_substr_next(struct dc_index_iter *it, struct dc_index_entry *e)
+{
+	const struct dc_index *idx = it->idx;
+	const char *w, *t, *end = idx->data + idx->size;
+	off_t pos;
+
+	for (;;) {
+		if (it->cand != NULL) {
+			if (it->cand == it->cand_end)
+				return NULL;
+			w = idx->data + *it->cand++;
+			pos = -1;
+		} else {
+			if (it->pos >= index_end(idx))
+				return NULL;
+			pos = it->pos;
+			w = index_line(idx, pos);
+			it->pos = index_pos_next(idx, pos);
+		}
+		if ((t = memchr(w, '\t', end - w)) == NULL)
+			return NULL;
+		if (memmem(w, t - w, it->key.word, it->key.len) == NULL)
+			continue;
+
+		it->left--;
+		if (pos == -1)
+			return index_parse_line(idx, w, e);
+		return index_entry(idx, pos, e);
+	}
+}
+
+struct index_match {
+	const struct dc_index	*idx;
+	const char		*pattern;
+	int			 glob;
+	off_t			 lo;
+	off_t			 hi;
+	off_t			*found;
+	size_t			 n;
+	int			 error;
+};
+
+/*
+ * Match the headwords of the lines in [lo, hi) against the pattern.
+ * Every thread compiles a regex of its own, as regexec() may serialize
+ * threads sharing one.
+ */
+static void *
+index_match_part(void *arg)
+{
+	struct index_match *sp = arg;
+	const struct dc_index *idx = sp->idx;
+	const char *w, *t, *end = idx->data + idx->size;
+	char word[WORD_MAX + 1];
+	regex_t re;
+	size_t nmax = 0, len;
+	off_t pos, *nf;
+	int r;
+
+	if (!sp->glob &&
+	    regcomp(&re, sp->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		sp->error = 1;
+		return NULL;
+	}
+
+	for (pos = sp->lo; pos < sp->hi; pos = index_pos_next(idx, pos)) {
+		w = index_line(idx, pos);
+		if ((t = memchr(w, '\t', end - w)) == NULL)
+			break;
+		len = MIN(t - w, WORD_MAX);
+		memcpy(word, w, len);
+		word[len] = '\0';
+		if (sp->glob)
+			r = fnmatch(sp->pattern, word, 0) == 0;
+		else
+			r = regexec(&re, word, 0, NULL, 0) == 0;
+		if (!r)
+			continue;
+
+		if (sp->n == nmax) {
+			nmax = nmax ? nmax * 2 : 64;
+			if ((nf = reallocarray(sp->found, nmax,
+			    sizeof(*nf))) == NULL) {
+				sp->error = 1;
+				break;
+			}
+			sp->found = nf;
+		}
+		sp->found[sp->n++] = pos;
+	}
+
+	if (!sp->glob)
+		regfree(&re);
+	return NULL;
+}
+
+/*
+ * Return the position of the first line starting at or after the
+ * i-th of n equal parts of [lo, hi).
+ */
+static off_t
+index_split(const struct dc_index *idx, off_t lo, off_t hi, int i, int n)
+{
+	const char *p, *end = idx->data + hi;
+
+	if (i == 0)
+		return lo;
+	if (i == n)
+		return hi;
+	if (idx->lines != NULL)
+		return lo + (hi - lo) / n * i;
+	p = idx->data + lo + (hi - lo) / n * i;
+	if ((p = memchr(p, '\n', end - p)) == NULL)
+		return hi;
+	return p + 1 - idx->data;
+}
+
+/*
+ * Collect the lines in [lo, hi) whose headword matches the pattern,
+ * large ranges are split across threads.
+ */
+static int
+index_match_range(struct dc_index_iter *it, off_t lo, off_t hi, int glob)
+{
+	const struct dc_index *idx = it->idx;
+	struct index_match *parts;
+	pthread_t *threads;
+	off_t bytes;
+	size_t n;
+	int jobs, i, started, error = 0;
+
+	bytes = idx->lines == NULL ? hi - lo :
+	    (off_t)((hi - lo) * (idx->size / MAX(idx->nlines, 1)));
+	jobs = MAX(1, MIN(it->key.jobs, bytes / SCAN_PART));
+	if ((parts = calloc(jobs, sizeof(*parts))) == NULL ||
+	    (threads = calloc(jobs, sizeof(*threads))) == NULL) {
+		free(parts);
+		return -1;
+	}
+	for (i = 0; i < jobs; i++) {
+		parts[i].idx = idx;
+		parts[i].pattern = it->key.word;
+		parts[i].glob = glob;
+		parts[i].lo = index_split(idx, lo, hi, i, jobs);
+		parts[i].hi = index_split(idx, lo, hi, i + 1, jobs);
+	}
+
+	for (started = 1; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, index_match_part,
+		    &parts[started]) != 0)
+			break;
+	index_match_part(&parts[0]);
+	for (i = 1; i < jobs; i++) {
+		if (i < started)
+			pthread_join(threads[i], NULL);
+		else
+			index_match_part(&parts[i]);
+	}
+
+	for (n = 0, i = 0; i < jobs; i++) {
+		error |= parts[i].error;
+		n += parts[i].n;
+	}
+	it->nfound = it->next_found = 0;
+	if (!error && (it->found = reallocarray(NULL, n + 1,
+	    sizeof(*it->found))) != NULL) {
+		for (i = 0; i < jobs; i++) {
+			if (parts[i].n == 0)
+				continue;
+			memcpy(it->found + it->nfound, parts[i].found,
+			    parts[i].n * sizeof(*it->found));
+			it->nfound += parts[i].n;
+		}
+	} else
+		error = 1;
+
+	for (i = 0; i < jobs; i++)
+		free(parts[i].found);
+	free(parts);
+	free(threads);
+	return error ? -1 : 0;
+}
+
+/*
+ * Only lines starting with the literal prefix of a pattern can match,
+ * they are found with two searches.  Patterns without a prefix are
+ * matched against every line.
+ */
+static int
+index_pattern_begin(struct dc_index_iter *it, size_t skip, size_t len,
+    int glob)
+{
+	const struct dc_index *idx = it->idx;
+	struct dc_query pre;
+	off_t lo = 0, hi = index_end(idx);
+
+	if (len > 0) {
+		pre.word = it->key.word + skip;
+		pre.len = len;
+		lo = index_bsearch(&pre, idx, 0, hi, index_prefix_cmp);
+		hi = index_gallop(&pre, idx, lo, index_after_cmp);
+	}
+	return index_match_range(it, lo, hi, glob);
+}
+
+/*
+ * A pattern anchored with ^ starts with the literals up to the first
+ * special character.  A literal followed by a quantifier that allows
+ * zero repetitions is not part of the prefix, alternations at any
+ * place rule it out.
+ */
+static int
+index_re_begin(struct dc_index_iter *it)
+{
+	const char *re = it->key.word;
+	size_t i, len = it->key.len;
+
+	if (len == 0 || re[0] != '^' || memchr(re, '|', len) != NULL)
+		return index_pattern_begin(it, 0, 0, 0);
+
+	for (i = 1; i < len && strchr(".[]()*+?{}|\\^$", re[i]) == NULL; i++)
+		;
+	if (i > 1 && i < len && strchr("*?{", re[i]) != NULL)
+		i--;
+	return index_pattern_begin(it, 1, i - 1, 0);
+}
+
+static int
+index_glob_begin(struct dc_index_iter *it)
+{
+	return index_pattern_begin(it, 0, strcspn(it->key.word, "*?[\\"), 1);
+}
+
+static struct dc_index_entry *
+index_found_next(struct dc_index_iter *it, struct dc_index_entry *e)
+{
+	if (it->found == NULL || it->next_found == it->nfound)
+		return NULL;
+	it->left--;
+	return index_entry(it->idx, it->found[it->next_found++], e);
+}
+
+const struct dc_strategy index_strategies[] = {
+	{ "exact",	"Match headwords exactly",	index_exact_cmp,
+	    NULL,		NULL,			NULL,
+	    NULL,		NULL },
+	{ "prefix",	"Match prefixes",		index_prefix_cmp,
+	    NULL,		NULL,			NULL,
+	    NULL,		NULL },
+	{ "suffix",	"Match suffixes",		index_prefix_cmp,
+	    index_reverse,	index_rev_open,		index_rev,
+	    NULL,		NULL },
+	{ "soundex",	"Match using SOUNDEX algorithm",	index_exact_cmp,
+	    index_soundex,	index_sdx_open,		index_sdx,
+	    NULL,		NULL },
+	{ "lev",	"Match headwords within a Levenshtein distance",
+	    NULL,
+	    NULL,		NULL,			NULL,
+	    index_fuzzy_begin,	index_fuzzy_next },
+	{ "substring",	"Match substrings",		NULL,
+	    NULL,		index_tri_open,		NULL,
+	    index_substr_begin,	index_substr_next },
+	{ "re",		"POSIX 1003.2 (modern) regular expressions",
+	    NULL,
+	    NULL,		NULL,			NULL,
+	    index_re_begin,	index_found_next },
+	{ "glob",	"Match headwords with a shell pattern",	NULL,
+	    NULL,		NULL,			NULL,
+	    index_glob_begin,	index_found_next },
+	{ NULL,		NULL,				NULL,
+	    NULL,		NULL,			NULL,
+	    NULL,		NULL }
+};
+
+/*
+ * Add the counters of all indexes to st.
+ */
+void
+index_stats(struct dc_stats *st)
+{
+	st->probes += __atomic_load_n(&index_counters.probes,
+	    __ATOMIC_RELAXED);
+	st->compares += __atomic_load_n(&index_counters.compares,
+	    __ATOMIC_RELAXED);
+	st->parsed += __atomic_load_n(&index_counters.parsed,
+	    __ATOMIC_RELAXED);
+	st->filtered += __atomic_load_n(&index_counters.filtered,
+	    __ATOMIC_RELAXED);
+}
+
+const struct dc_strategy *
+index_strategy(const char *name)
+{
+	const struct dc_strategy *st;
+
+	for (st = index_strategies; st->name != NULL; st++)
+		if (strcmp(st->name, name) == 0)
+			return st;
+	return NULL;
+}
+
+/*
+ * Map foo-bar.index.bin if it was written for the current index.  The
+ * lines are trusted only if they start in ascending order and their
+ * headwords lie within the index, else the index is validated instead.
+ */
+int
+index_table_open(struct dc_index *idx)
+{
+	struct dc_sidecar *sc = &idx->table;
+	const struct dc_line *lines;
+	uint64_t prev = 0;
+	size_t i;
+
+	if (sidecar_open(sc, idx, TABLE_EXT, TABLE_MAGIC, TABLE_VERSION) == -1)
+		return -1;
+
+	lines = sc->data;
+	if (sc->count == 0 || sc->len != sc->count * sizeof(*lines))
+		goto fail;
+	for (i = 0; i < sc->count; i++) {
+		if ((i > 0 && lines[i].off <= prev) ||
+		    lines[i].off >= (uint64_t)idx->size ||
+		    lines[i].match_len > (uint64_t)idx->size - lines[i].off)
+			goto fail;
+		prev = lines[i].off;
+	}
+
+	idx->lines = lines;
+	idx->nlines = sc->count;
+	return 0;
+
+ fail:
+	sidecar_close(sc);
+	return -1;
+}
+
+int
+index_table_write(const struct dc_index *idx)
+{
+	struct iovec iov;
+
+	if (idx->lines == NULL)
+		return -1;
+
+	iov.iov_base = (void *)idx->lines;
+	iov.iov_len = idx->nlines * sizeof(*idx->lines);
+	return sidecar_write(idx, TABLE_EXT, TABLE_MAGIC, TABLE_VERSION,
+	    idx->nlines, &iov, 1);
+}
+
+/*
+ * Map foo-bar.index.bloom if it was written for the current index.
+ * The blocks follow a header of 24 bytes with k, so they start on a
+ * cache line of the file.
+ */
+int
+index_bloom_open(struct dc_index *idx)
+{
+	struct dc_bloom *b;
+	const uint32_t *head;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return -1;
+	if (sidecar_open(&b->sc, idx, BLOOM_EXT, BLOOM_MAGIC,
+	    BLOOM_VERSION) == -1) {
+		free(b);
+		return -1;
+	}
+
+	head = b->sc.data;
+	if (b->sc.count == 0 || b->sc.len < 24 ||
+	    (b->sc.len - 24) / (BLOOM_BITS / 8) != b->sc.count ||
+	    (b->sc.len - 24) % (BLOOM_BITS / 8) != 0 ||
+	    head[0] == 0 || head[0] > BLOOM_K_MAX) {
+		sidecar_close(&b->sc);
+		free(b);
+		return -1;
+	}
+	b->k = head[0];
+	b->blocks = (const uint64_t *)((const char *)b->sc.data + 24);
+	b->nblocks = b->sc.count;
+	idx->bloom = b;
+	return 0;
+}
+
+/*
+ * Write a filter of the headwords with a false positive rate of about
+ * 1 in rate.  Each bit of k halves the rate, the bits per headword are
+ * k / ln 2 with some to spare for the uneven load of the blocks.
+ */
+int
+index_bloom_write(const struct dc_index *idx, uint32_t rate)
+{
+	struct dc_bloom b;
+	struct iovec iov[2];
+	uint32_t head[6], bits[BLOOM_K_MAX], i;
+	const char *p, *end = idx->data + idx->size, *nl, *tab;
+	uint64_t *blk;
+	size_t n = 0, block;
+	int ret;
+
+	memset(&b, 0, sizeof(b));
+	while (b.k < BLOOM_K_MAX && (1ULL << b.k) < rate)
+		b.k++;
+	b.k = MAX(b.k, 1);
+
+	for (p = idx->data; p < end && (nl = memchr(p, '\n', end - p));
+	    p = nl + 1)
+		n++;
+	b.nblocks = MAX((n * b.k * 8 / 5 + BLOOM_BITS - 1) / BLOOM_BITS, 1);
+	if ((b.blocks = calloc(b.nblocks, BLOOM_BITS / 8)) == NULL)
+		return -1;
+
+	for (p = idx->data; p < end && (nl = memchr(p, '\n', end - p));
+	    p = nl + 1) {
+		if ((tab = memchr(p, '\t', nl - p)) == NULL)
+			continue;
+		index_bloom_bits(&b, index_hash(p, tab - p), &block, bits);
+		blk = (uint64_t *)b.blocks + block * (BLOOM_BITS / 64);
+		for (i = 0; i < b.k; i++)
+			blk[bits[i] / 64] |= 1ULL << (bits[i] % 64);
+	}
+
+	memset(head, 0, sizeof(head));
+	head[0] = b.k;
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (void *)b.blocks;
+	iov[1].iov_len = b.nblocks * (BLOOM_BITS / 8);
+	ret = sidecar_write(idx, BLOOM_EXT, BLOOM_MAGIC, BLOOM_VERSION,
+	    b.nblocks, iov, 2);
+	free((void *)b.blocks);
+	return ret;
+}
+
+static void
+index_bloom_close(struct dc_bloom *b)
+{
+	if (b == NULL)
+		return;
+	sidecar_close(&b->sc);
+	free(b);
+}
+
+/*
+ * Free a line table and its keys, unless they are in a sidecar.
+ */
+static void
+index_table_close(struct dc_index *idx)
+{
+	if (idx->table.map != NULL) {
+		sidecar_close(&idx->table);
+		return;
+	}
+	if (idx->src != NULL)	/* the keys of a derived index */
+		free((void *)idx->data);
+	free((void *)idx->src);
+	free((void *)idx->lines);
+}
+
+static void
+index_derived_close(struct dc_index *d)
+{
+	if (d == NULL)
+		return;
+	index_table_close(d);
+	free(d);
+}
+
+static void
+index_tri_close(struct dc_trigrams *tri)
+{
+	if (tri == NULL)
+		return;
+	if (tri->sc.map != NULL) {
+		sidecar_close(&tri->sc);
+	} else {
+		free((void *)tri->grams);
+		free((void *)tri->post);
+	}
+	free(tri);
+}
+
+static void
+index_delta_close(struct dc_index *d)
+{
+	if (d == NULL)
+		return;
+	index_close(d);
+	if (d->text != NULL)
+		munmap((void *)d->text, d->textlen);
+	free((void *)d->path);
+	free(d);
+}
+
+/*
+ * Open foo-bar.delta.index, the overlay of foo-bar.index, and map its
+ * definitions in foo-bar.delta.dict.  Without an overlay there is
+ * nothing to do.  It is small, so it is always validated.
+ */
+int
+index_delta_open(struct dc_index *idx)
+{
+	struct dc_index *d = NULL;
+	struct stat sb;
+	char *path = NULL, *text = NULL;
+	void *map;
+	size_t len;
+	int fd, saved;
+
+	len = strlen(idx->path);
+	if (len < 6 || strcmp(idx->path + len - 6, ".index") != 0)
+		return 0;
+	len -= 6;
+	if (asprintf(&path, "%.*s%s", (int)len, idx->path, DELTA_INDEX) == -1)
+		return -1;
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		saved = errno;
+		free(path);
+		errno = saved;
+		return errno == ENOENT ? 0 : -1;
+	}
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		goto fail;
+	d->path = path;
+	d->writable = idx->writable;
+	path = NULL;
+	if (index_open(fd, d) == -1)
+		goto fail;
+	close(fd);
+
+	if (asprintf(&text, "%.*s%s", (int)len, idx->path, DELTA_TEXT) == -1) {
+		text = NULL;
+		fd = -1;
+		goto fail;
+	}
+	if ((fd = open(text, O_RDONLY)) == -1 || fstat(fd, &sb) == -1)
+		goto fail;
+	if (sb.st_size > 0) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			goto fail;
+		d->text = map;
+		d->textlen = sb.st_size;
+	}
+	close(fd);
+	fd = -1;
+	if (index_validate(d, d->textlen, 1) == -1) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	free(text);
+	idx->delta = d;
+	return 0;
+
+ fail:
+	saved = errno;
+	if (fd != -1)
+		close(fd);
+	index_delta_close(d);
+	free(text);
+	free(path);
+	errno = saved;
+	return -1;
+}
+
+void
+index_close(struct dc_index *idx)
 {
-	return index_find(req, idx, list, index_exact_cmp);
+	index_delta_close(idx->delta);
+	idx->delta = NULL;
+	index_derived_close(idx->rev);
+	index_derived_close(idx->sdx);
+	index_tri_close(idx->tri);
+	index_bloom_close(idx->bloom);
+	index_table_close(idx);
+	if (idx->data != NULL)
+		munmap((void *)idx->data, idx->size);
+	idx->data = NULL;
+	idx->lines = NULL;
+	idx->rev = idx->sdx = NULL;
+	idx->tri = NULL;
+	idx->bloom = NULL;
 }
@@ -15,11 +15,32 @@
  */
 
 struct dc_index;
-struct dc_index_list;
+struct dc_index_entry;
+struct dc_index_iter;
+struct dc_query;
+struct dc_stats;
+struct dc_strategy;
+
+extern const struct dc_strategy index_strategies[];
 
 int index_open(int, struct dc_index *);
-int index_validate(struct dc_index *, off_t);
-int index_exact_find(const char *, const struct dc_index *,
-    struct dc_index_list *);
-int index_prefix_find(const char *, const struct dc_index *,
-    struct dc_index_list *);
+void index_close(struct dc_index *);
+int index_validate(struct dc_index *, off_t, int);
+int index_table_open(struct dc_index *);
+int index_table_write(const struct dc_index *);
+int index_delta_open(struct dc_index *);
+int index_bloom_open(struct dc_index *);
+int index_bloom_write(const struct dc_index *, uint32_t);
+const struct dc_strategy *index_strategy(const char *);
+void index_stats(struct dc_stats *);
+void index_query(struct dc_query *, const struct dc_strategy *, char *);
+void index_locate(const struct dc_strategy *, const struct dc_query *,
+    size_t, const struct dc_index *, off_t *);
+int index_iter_begin(struct dc_index_iter *, const struct dc_strategy *,
+    const struct dc_query *, const struct dc_index *);
+int index_iter_at(struct dc_index_iter *, const struct dc_strategy *,
+    const struct dc_query *, off_t, const struct dc_index *);
+void index_iter_page(struct dc_index_iter *, size_t, size_t);
+struct dc_index_entry *index_iter_next(struct dc_index_iter *,
+    struct dc_index_entry *);
+void index_iter_end(struct dc_index_iter *);
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * libopendict, lookups for programs that embed them.  An od_dict is
+ * only read after od_open() and shared by all threads, everything a
+ * lookup writes to is in the od_ctx of the calling thread.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "dict.h"
+#include "index.h"
+#include "opendict.h"
+
+struct od_dict {
+	struct dc_database	 db;
+	char			*path;
+	pthread_mutex_t		 mtx;	/* held while opening derived indexes */
+};
+
+struct od_ctx {
+	struct od_dict		*dict;
+	struct dc_reader	*reader;
+	char			*buf;	/* the current definition */
+	size_t			 buflen;
+	char			 word[WORD_MAX + 1];
+};
+
+struct od_dict *
+od_open(const char *index, const char *dict)
+{
+	struct od_dict *d;
+	int db_fd = -1, idx_fd = -1, saved;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return NULL;
+	if ((d->path = strdup(index)) == NULL)
+		goto fail;
+	d->db.index.path = d->path;
+	d->db.index.writable = 1;
+
+	if ((db_fd = open(dict, O_RDONLY)) == -1 ||
+	    (idx_fd = open(index, O_RDONLY)) == -1)
+		goto fail;
+	if (database_open(db_fd, &d->db) == -1 ||
+	    index_open(idx_fd, &d->db.index) == -1)
+		goto fail;
+
+	if (index_table_open(&d->db.index) == -1) {
+		if (index_validate(&d->db.index, d->db.size, 1) == -1) {
+			errno = EFTYPE;
+			goto fail;
+		}
+		(void)index_table_write(&d->db.index);
+	}
+	(void)index_bloom_open(&d->db.index);
+	if (index_delta_open(&d->db.index) == -1)
+		goto fail;
+
+	if ((errno = pthread_mutex_init(&d->mtx, NULL)) != 0)
+		goto fail;
+
+	close(db_fd);
+	close(idx_fd);
+	return d;
+
+ fail:
+	saved = errno;
+	if (db_fd != -1)
+		close(db_fd);
+	if (idx_fd != -1)
+		close(idx_fd);
+	index_close(&d->db.index);
+	database_close(&d->db);
+	free(d->path);
+	free(d);
+	errno = saved;
+	return NULL;
+}
+
+/*
+ * All contexts of the dictionary must have been freed.
+ */
+void
+od_close(struct od_dict *d)
+{
+	if (d == NULL)
+		return;
+
+	pthread_mutex_destroy(&d->mtx);
+	index_close(&d->db.index);
+	database_close(&d->db);
+	free(d->path);
+	free(d);
+}
+
+/*
+ * A context keeps up to nchunks inflated chunks of the dictionary, at
+ * least one.
+ */
+struct od_ctx *
+od_ctx_new(struct od_dict *d, size_t nchunks)
+{
+	struct od_ctx *ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx->dict = d;
+	if ((ctx->reader = database_reader(&d->db, nchunks)) == NULL) {
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void
+od_ctx_free(struct od_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	database_reader_free(ctx->reader);
+	free(ctx->buf);
+	free(ctx);
+}
+
+static int
+od_lookup(struct od_ctx *ctx, const char *strategy, const char *word,
+    int define, od_result_fn fn, void *arg)
+{
+	struct od_dict *d = ctx->dict;
+	const struct dc_strategy *strat;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_query q;
+	const char *def, *prev_match = NULL;
+	size_t len, prev_len = 0;
+	char *buf;
+	int n = 0, r;
+
+	if ((strat = index_strategy(strategy)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((len = strlen(word)) >= sizeof(ctx->word)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(ctx->word, word, len + 1);
+	index_query(&q, strat, ctx->word);
+
+	/* derived indexes are opened by the first lookup that needs them */
+	if (strat->open != NULL) {
+		pthread_mutex_lock(&d->mtx);
+		r = strat->open(&d->db.index);
+		pthread_mutex_unlock(&d->mtx);
+		if (r == -1)
+			return -1;
+	}
+
+	if (index_iter_begin(&it, strat, &q, &d->db.index) == -1) {
+		index_iter_end(&it);
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (index_iter_next(&it, &e) != NULL) {
+		if (!define) {
+			if (prev_len > 0 && prev_len == e.match_len &&
+			    memcmp(prev_match, e.match, prev_len) == 0)
+				continue;
+			prev_len = e.match_len;
+			prev_match = e.match;
+			n++;
+			if (fn(arg, e.match, e.match_len, NULL, 0) != 0)
+				break;
+			continue;
+		}
+
+		/* uncompressed definitions are passed from the mapping */
+		if ((def = database_mapped(&d->db, &e)) != NULL) {
+			n++;
+			if (fn(arg, e.match, e.match_len, def, e.def_len) != 0)
+				break;
+			continue;
+		}
+
+		if (e.def_len > ctx->buflen) {
+			if ((buf = realloc(ctx->buf, e.def_len)) == NULL) {
+				n = -1;
+				break;
+			}
+			ctx->buf = buf;
+			ctx->buflen = e.def_len;
+		}
+		if (database_read(ctx->reader, &e, ctx->buf) == -1) {
+			errno = EIO;
+			n = -1;
+			break;
+		}
+		n++;
+		if (fn(arg, e.match, e.match_len, ctx->buf, e.def_len) != 0)
+			break;
+	}
+
+	index_iter_end(&it);
+	return n;
+}
+
+/*
+ * Call fn once for every distinct headword matching the word, def is
+ * NULL.  Return the number of calls or -1.
+ */
+int
+od_match(struct od_ctx *ctx, const char *strategy, const char *word,
+    od_result_fn fn, void *arg)
+{
+	return od_lookup(ctx, strategy, word, 0, fn, arg);
+}
+
+/*
+ * Call fn with every definition of a headword matching the word.
+ * Return the number of calls or -1.
+ */
+int
+od_define(struct od_ctx *ctx, const char *strategy, const char *word,
+    od_result_fn fn, void *arg)
+{
+	return od_lookup(ctx, strategy, word, 1, fn, arg);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _OPENDICT_H_
+#define _OPENDICT_H_
+
+#include <stddef.h>
+
+struct od_dict;
+struct od_ctx;
+
+/* return non-zero to stop the lookup */
+typedef int (*od_result_fn)(void *, const char *, size_t, const char *,
+    size_t);
+
+struct od_dict *od_open(const char *, const char *);
+void od_close(struct od_dict *);
+struct od_ctx *od_ctx_new(struct od_dict *, size_t);
+void od_ctx_free(struct od_ctx *);
+int od_match(struct od_ctx *, const char *, const char *, od_result_fn,
+    void *);
+int od_define(struct od_ctx *, const char *, const char *, od_result_fn,
+    void *);
+
+#endif /* _OPENDICT_H_ */
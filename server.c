@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A small server for the DICT protocol, RFC 2229.  All dictionaries are
+ * opened once at startup, connections are multiplexed with poll(2).
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "dict.h"
+#include "index.h"
+#include "server.h"
+
+#define DICT_HOST	"127.0.0.1"
+#define DICT_PORT	"2628"
+#define CMD_MAX		1024		/* RFC 2229, 2.2 */
+#define CMD_ARGS	8
+#define OUT_HIWAT	(256 * 1024)	/* stop reading above this */
+
+struct buf {
+	char		*data;
+	size_t		 len;
+	size_t		 cap;
+};
+
+struct conn {
+	int		 fd;
+	char		 in[CMD_MAX];
+	size_t		 inlen;
+	int		 discard;	/* skipping an overlong line */
+	struct buf	 out;
+	size_t		 outoff;
+	int		 mime;
+	int		 quit;
+};
+
+struct server {
+	struct dc_database	*dbs;
+	size_t			 ndbs;
+	struct buf		 body;
+	u_int			 nconn;
+};
+
+static void
+buf_add(struct buf *b, const void *data, size_t len)
+{
+	size_t cap;
+	char *p;
+
+	if (b->len + len > b->cap) {
+		cap = MAX(b->cap * 2, b->len + len);
+		cap = MAX(cap, 4096);
+		if ((p = realloc(b->data, cap)) == NULL)
+			err(1, NULL);
+		b->data = p;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void
+buf_printf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int len;
+
+	va_start(ap, fmt);
+	len = vasprintf(&s, fmt, ap);
+	va_end(ap);
+	if (len == -1)
+		err(1, NULL);
+	buf_add(b, s, len);
+	free(s);
+}
+
+static void
+buf_quote(struct buf *b, const char *s, size_t len)
+{
+	size_t i;
+
+	buf_add(b, "\"", 1);
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\')
+			buf_add(b, "\\", 1);
+		buf_add(b, &s[i], 1);
+	}
+	buf_add(b, "\"", 1);
+}
+
+/*
+ * Text responses end with a line holding a single dot, so lines
+ * starting with one get a second dot.  The text may come in pieces
+ * split anywhere, bol remembers if the next one starts a line.
+ */
+struct text {
+	struct buf	*b;
+	int		 bol;
+};
+
+static int
+buf_text(void *arg, const char *text, size_t len)
+{
+	struct text *t = arg;
+	const char *nl;
+	size_t l;
+
+	while (len > 0) {
+		if ((nl = memchr(text, '\n', len)) == NULL)
+			l = len;
+		else
+			l = nl - text;
+		if (t->bol && text[0] == '.')
+			buf_add(t->b, ".", 1);
+		buf_add(t->b, text, l);
+		t->bol = nl != NULL;
+		if (nl == NULL)
+			break;
+		buf_add(t->b, "\r\n", 2);
+		text += l + 1;
+		len -= l + 1;
+	}
+	return 0;
+}
+
+static void
+buf_text_end(struct text *t)
+{
+	if (!t->bol)
+		buf_add(t->b, "\r\n", 2);
+}
+
+static struct dc_database *
+server_db(struct server *srv, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < srv->ndbs; i++)
+		if (strcmp(srv->dbs[i].name, name) == 0)
+			return &srv->dbs[i];
+	return NULL;
+}
+
+static void
+cmd_define(struct server *srv, struct conn *c, int argc, char *argv[])
+{
+	const char *def;
+	const struct dc_strategy *exact;
+	struct dc_database *db = NULL;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_query q;
+	struct buf *b = &srv->body;
+	struct text t;
+	size_t i, start;
+	int all, n = 0;
+
+	if (argc != 3) {
+		buf_printf(&c->out, "501 syntax error, illegal parameters\r\n");
+		return;
+	}
+	all = strcmp(argv[1], "*") == 0 || strcmp(argv[1], "!") == 0;
+	if (!all && (db = server_db(srv, argv[1])) == NULL) {
+		buf_printf(&c->out,
+		    "550 invalid database, use SHOW DB for list\r\n");
+		return;
+	}
+
+	exact = index_strategy("exact");
+	index_query(&q, exact, argv[2]);
+	b->len = 0;
+	for (i = 0; i < srv->ndbs; i++) {
+		if (!all && db != &srv->dbs[i])
+			continue;
+		if (index_iter_begin(&it, exact, &q, &srv->dbs[i].index) ==
+		    -1) {
+			index_iter_end(&it);
+			buf_printf(&c->out,
+			    "420 server temporarily unavailable\r\n");
+			return;
+		}
+		while (index_iter_next(&it, &e) != NULL) {
+			start = b->len;
+			buf_printf(b, "151 ");
+			buf_quote(b, e.match, e.match_len);
+			buf_printf(b, " %s ", srv->dbs[i].name);
+			buf_quote(b, srv->dbs[i].name, strlen(srv->dbs[i].name));
+			buf_printf(b, "\r\n%s", c->mime ?
+			    "Content-Type: text/plain; charset=utf-8\r\n\r\n" :
+			    "");
+			t.b = b;
+			t.bol = 1;
+			if ((def = database_mapped(&srv->dbs[i], &e)) != NULL)
+				buf_text(&t, def, e.def_len);
+			else if (database_stream(&e, &srv->dbs[i], buf_text,
+			    &t) == -1) {
+				/* drop the partial answer */
+				b->len = start;
+				continue;
+			}
+			buf_text_end(&t);
+			buf_printf(b, ".\r\n");
+			n++;
+		}
+		index_iter_end(&it);
+		if (n > 0 && strcmp(argv[1], "!") == 0)
+			break;
+	}
+
+	if (n == 0) {
+		buf_printf(&c->out, "552 no match\r\n");
+		return;
+	}
+	buf_printf(&c->out, "150 %d definitions retrieved\r\n", n);
+	buf_add(&c->out, b->data, b->len);
+	buf_printf(&c->out, "250 ok\r\n");
+}
+
+static void
+cmd_match(struct server *srv, struct conn *c, int argc, char *argv[])
+{
+	const struct dc_strategy *strat;
+	struct dc_database *db = NULL;
+	struct dc_index_iter it;
+	struct dc_index_entry e;
+	struct dc_query q;
+	struct buf *b = &srv->body;
+	const char *prev;
+	size_t i;
+	int all, n = 0, prev_len;
+
+	if (argc != 4) {
+		buf_printf(&c->out, "501 syntax error, illegal parameters\r\n");
+		return;
+	}
+	all = strcmp(argv[1], "*") == 0 || strcmp(argv[1], "!") == 0;
+	if (!all && (db = server_db(srv, argv[1])) == NULL) {
+		buf_printf(&c->out,
+		    "550 invalid database, use SHOW DB for list\r\n");
+		return;
+	}
+	if ((strat = index_strategy(strcmp(argv[2], ".") == 0 ?
+	    "prefix" : argv[2])) == NULL) {
+		buf_printf(&c->out,
+		    "551 invalid strategy, use SHOW STRAT for list\r\n");
+		return;
+	}
+
+	index_query(&q, strat, argv[3]);
+	b->len = 0;
+	for (i = 0; i < srv->ndbs; i++) {
+		if (!all && db != &srv->dbs[i])
+			continue;
+		/* like a regular expression that does not compile */
+		if (index_iter_begin(&it, strat, &q, &srv->dbs[i].index) ==
+		    -1) {
+			index_iter_end(&it);
+			buf_printf(&c->out,
+			    "501 syntax error, illegal parameters\r\n");
+			return;
+		}
+		prev = NULL;
+		prev_len = 0;
+		while (index_iter_next(&it, &e) != NULL) {
+			if (prev != NULL && prev_len == e.match_len &&
+			    strncmp(prev, e.match, prev_len) == 0)
+				continue;
+			prev = e.match;
+			prev_len = e.match_len;
+			buf_printf(b, "%s ", srv->dbs[i].name);
+			buf_quote(b, e.match, e.match_len);
+			buf_printf(b, "\r\n");
+			n++;
+		}
+		index_iter_end(&it);
+		if (n > 0 && strcmp(argv[1], "!") == 0)
+			break;
+	}
+
+	if (n == 0) {
+		buf_printf(&c->out, "552 no match\r\n");
+		return;
+	}
+	buf_printf(&c->out, "152 %d matches found\r\n", n);
+	buf_add(&c->out, b->data, b->len);
+	buf_printf(&c->out, ".\r\n250 ok\r\n");
+}
+
+static void
+cmd_show(struct server *srv, struct conn *c, int argc, char *argv[])
+{
+	const struct dc_strategy *st;
+	struct dc_database *db;
+	size_t i, n;
+
+	if (argc >= 2 && (strcasecmp(argv[1], "DB") == 0 ||
+	    strcasecmp(argv[1], "DATABASES") == 0)) {
+		buf_printf(&c->out, "110 %zu databases present\r\n",
+		    srv->ndbs);
+		for (i = 0; i < srv->ndbs; i++) {
+			buf_printf(&c->out, "%s ", srv->dbs[i].name);
+			buf_quote(&c->out, srv->dbs[i].name,
+			    strlen(srv->dbs[i].name));
+			buf_printf(&c->out, "\r\n");
+		}
+		buf_printf(&c->out, ".\r\n250 ok\r\n");
+	} else if (argc >= 2 && (strcasecmp(argv[1], "STRAT") == 0 ||
+	    strcasecmp(argv[1], "STRATEGIES") == 0)) {
+		for (n = 0, st = index_strategies; st->name != NULL; st++)
+			n++;
+		buf_printf(&c->out, "111 %zu strategies available\r\n", n);
+		for (st = index_strategies; st->name != NULL; st++) {
+			buf_printf(&c->out, "%s ", st->name);
+			buf_quote(&c->out, st->desc, strlen(st->desc));
+			buf_printf(&c->out, "\r\n");
+		}
+		buf_printf(&c->out, ".\r\n250 ok\r\n");
+	} else if (argc == 3 && strcasecmp(argv[1], "INFO") == 0) {
+		if ((db = server_db(srv, argv[2])) == NULL) {
+			buf_printf(&c->out,
+			    "550 invalid database, use SHOW DB for list\r\n");
+			return;
+		}
+		buf_printf(&c->out, "112 database information follows\r\n"
+		    "%s: %lld bytes of index, %lld bytes of definitions\r\n"
+		    ".\r\n250 ok\r\n", db->name, (long long)db->index.size,
+		    (long long)db->size);
+	} else if (argc == 2 && strcasecmp(argv[1], "SERVER") == 0) {
+		buf_printf(&c->out, "114 server information follows\r\n"
+		    "opendict, %zu databases\r\n.\r\n250 ok\r\n", srv->ndbs);
+	} else
+		buf_printf(&c->out, "501 syntax error, illegal parameters\r\n");
+}
+
+/*
+ * Split a command line into words, honouring quotes and backslashes.
+ */
+static int
+cmd_args(char *line, char *argv[], int max)
+{
+	char *p = line, *q;
+	int argc = 0, quote;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0')
+			break;
+		if (argc == max)
+			return -1;
+		argv[argc++] = q = p;
+		quote = 0;
+		while (*p != '\0') {
+			if (quote == 0 && (*p == ' ' || *p == '\t')) {
+				p++;
+				break;
+			}
+			if (*p == '\\' && p[1] != '\0') {
+				*q++ = p[1];
+				p += 2;
+			} else if (quote == 0 && (*p == '"' || *p == '\'')) {
+				quote = *p++;
+			} else if (quote != 0 && *p == quote) {
+				quote = 0;
+				p++;
+			} else
+				*q++ = *p++;
+		}
+		if (quote != 0)
+			return -1;
+		*q = '\0';
+	}
+
+	return argc;
+}
+
+static void
+server_command(struct server *srv, struct conn *c, char *line)
+{
+	char *argv[CMD_ARGS];
+	int argc;
+
+	if ((argc = cmd_args(line, argv, CMD_ARGS)) == -1) {
+		buf_printf(&c->out, "501 syntax error, illegal parameters\r\n");
+		return;
+	}
+	if (argc == 0)
+		return;
+
+	if (strcasecmp(argv[0], "DEFINE") == 0 ||
+	    strcasecmp(argv[0], "D") == 0) {
+		cmd_define(srv, c, argc, argv);
+	} else if (strcasecmp(argv[0], "MATCH") == 0 ||
+	    strcasecmp(argv[0], "M") == 0) {
+		cmd_match(srv, c, argc, argv);
+	} else if (strcasecmp(argv[0], "SHOW") == 0) {
+		cmd_show(srv, c, argc, argv);
+	} else if (strcasecmp(argv[0], "CLIENT") == 0) {
+		buf_printf(&c->out, "250 ok\r\n");
+	} else if (strcasecmp(argv[0], "OPTION") == 0 && argc == 2 &&
+	    strcasecmp(argv[1], "MIME") == 0) {
+		c->mime = 1;
+		buf_printf(&c->out, "250 ok - using MIME headers\r\n");
+	} else if (strcasecmp(argv[0], "STATUS") == 0) {
+		buf_printf(&c->out, "210 status ok\r\n");
+	} else if (strcasecmp(argv[0], "HELP") == 0) {
+		buf_printf(&c->out, "113 help text follows\r\n"
+		    "DEFINE database word\r\n"
+		    "MATCH database strategy word\r\n"
+		    "SHOW DB\r\n"
+		    "SHOW STRAT\r\n"
+		    "SHOW INFO database\r\n"
+		    "SHOW SERVER\r\n"
+		    "CLIENT info\r\n"
+		    "OPTION MIME\r\n"
+		    "STATUS\r\n"
+		    "HELP\r\n"
+		    "QUIT\r\n"
+		    ".\r\n250 ok\r\n");
+	} else if (strcasecmp(argv[0], "QUIT") == 0 ||
+	    strcasecmp(argv[0], "Q") == 0) {
+		buf_printf(&c->out, "221 bye\r\n");
+		c->quit = 1;
+	} else if (strcasecmp(argv[0], "AUTH") == 0 ||
+	    strcasecmp(argv[0], "SASLAUTH") == 0) {
+		buf_printf(&c->out, "502 command not implemented\r\n");
+	} else
+		buf_printf(&c->out, "500 unknown command\r\n");
+}
+
+static int
+conn_read(struct server *srv, struct conn *c)
+{
+	char *nl;
+	size_t len;
+	ssize_t n;
+
+	n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+	if (n == -1)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (n == 0)
+		return -1;
+	c->inlen += n;
+
+	while (!c->quit && (nl = memchr(c->in, '\n', c->inlen)) != NULL) {
+		*nl = '\0';
+		len = nl - c->in;
+		if (len > 0 && c->in[len - 1] == '\r')
+			c->in[len - 1] = '\0';
+		if (c->discard)
+			c->discard = 0;
+		else
+			server_command(srv, c, c->in);
+		c->inlen -= len + 1;
+		memmove(c->in, nl + 1, c->inlen);
+	}
+
+	if (c->inlen == sizeof(c->in)) {
+		if (!c->discard)
+			buf_printf(&c->out, "500 line too long\r\n");
+		c->discard = 1;
+		c->inlen = 0;
+	}
+
+	return 0;
+}
+
+static int
+conn_flush(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->outoff < c->out.len) {
+		n = write(c->fd, c->out.data + c->outoff,
+		    c->out.len - c->outoff);
+		if (n == -1)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		c->outoff += n;
+	}
+	c->out.len = c->outoff = 0;
+
+	return 0;
+}
+
+static void
+conn_close(struct conn *c)
+{
+	close(c->fd);
+	free(c->out.data);
+	free(c);
+}
+
+static struct conn *
+conn_accept(struct server *srv, int lfd)
+{
+	struct conn *c;
+	int fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			warn("accept");
+		return NULL;
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    (c = calloc(1, sizeof(*c))) == NULL) {
+		warn(NULL);
+		close(fd);
+		return NULL;
+	}
+	c->fd = fd;
+	buf_printf(&c->out, "220 opendict <mime> <%ld.%u@opendict>\r\n",
+	    (long)getpid(), srv->nconn++);
+
+	return c;
+}
+
+/*
+ * Listen on a unix socket if address contains a slash, on [host:]port
+ * otherwise.  The host defaults to the loopback address.
+ */
+int
+server_listen(const char *address)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res, *ai;
+	char *host, *port, *p;
+	int fd = -1, on = 1, error;
+
+	if (strchr(address, '/') != NULL) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+		    address) >= sizeof(sun.sun_path))
+			errx(1, "socket path too long: %s", address);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		(void)unlink(address);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			err(1, "bind %s", address);
+	} else {
+		if ((host = strdup(address)) == NULL)
+			err(1, NULL);
+		if ((p = strrchr(host, ':')) != NULL) {
+			*p = '\0';
+			port = p + 1;
+			if (host[0] == '[' && p > host + 1 && p[-1] == ']') {
+				p[-1] = '\0';
+				host++;
+			}
+		} else {
+			port = host;
+			host = DICT_HOST;
+		}
+		if (*port == '\0')
+			port = DICT_PORT;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+		if ((error = getaddrinfo(host, port, &hints, &res)) != 0)
+			errx(1, "%s: %s", address, gai_strerror(error));
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol);
+			if (fd == -1)
+				continue;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+			    sizeof(on)) == 0 &&
+			    bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd == -1)
+			err(1, "bind %s", address);
+	}
+
+	if (listen(fd, 128) == -1)
+		err(1, "listen %s", address);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	return fd;
+}
+
+int
+server_run(int lfd, struct dc_database *dbs, size_t ndbs)
+{
+	struct server srv;
+	struct conn **conns = NULL, **nconns, *c;
+	struct pollfd *pfd = NULL, *npfd;
+	size_t n = 0, i, j;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.dbs = dbs;
+	srv.ndbs = ndbs;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((npfd = reallocarray(pfd, n + 1, sizeof(*pfd))) == NULL)
+			err(1, NULL);
+		pfd = npfd;
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < n; i++) {
+			c = conns[i];
+			pfd[i + 1].fd = c->fd;
+			pfd[i + 1].events = 0;
+			if (c->outoff < c->out.len)
+				pfd[i + 1].events |= POLLOUT;
+			if (!c->quit && c->out.len - c->outoff < OUT_HIWAT)
+				pfd[i + 1].events |= POLLIN;
+		}
+
+		if (poll(pfd, n + 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		for (i = 0, j = 0; i < n; i++) {
+			c = conns[i];
+			if ((pfd[i + 1].revents & (POLLIN|POLLHUP|POLLERR) &&
+			    conn_read(&srv, c) == -1) || conn_flush(c) == -1 ||
+			    (c->quit && c->outoff == c->out.len)) {
+				conn_close(c);
+				continue;
+			}
+			conns[j++] = c;
+		}
+		n = j;
+
+		if (pfd[0].revents & POLLIN) {
+			while ((c = conn_accept(&srv, lfd)) != NULL) {
+				nconns = reallocarray(conns, n + 1,
+				    sizeof(*conns));
+				if (nconns == NULL)
+					err(1, NULL);
+				conns = nconns;
+				conns[n++] = c;
+				if (conn_flush(c) == -1) {
+					conn_close(c);
+					n--;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
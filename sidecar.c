@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sidecars are binary files next to an index, e.g. foo-bar.index.bin.
+ * They carry data derived from the index and are only trusted as long
+ * as the size and mtime of the index match the ones in their header.
+ */
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dict.h"
+#include "sidecar.h"
+
+struct sidecar_hdr {
+	char		 magic[4];
+	uint32_t	 version;
+	uint64_t	 src_size;
+	int64_t		 src_sec;
+	int64_t		 src_nsec;
+	uint64_t	 count;
+};
+
+int
+sidecar_open(struct dc_sidecar *sc, const struct dc_index *idx,
+    const char *ext, const char *magic, uint32_t version)
+{
+	const struct sidecar_hdr *h;
+	struct stat sb;
+	char *path;
+	void *map;
+	int fd;
+
+	if (idx->path == NULL)
+		return -1;
+	if (asprintf(&path, "%s%s", idx->path, ext) == -1)
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	h = map;
+	if (memcmp(h->magic, magic, sizeof(h->magic)) != 0 ||
+	    h->version != version || h->src_size != (uint64_t)idx->size ||
+	    h->src_sec != idx->mtime.tv_sec ||
+	    h->src_nsec != idx->mtime.tv_nsec) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+
+	sc->map = map;
+	sc->maplen = sb.st_size;
+	sc->data = (const char *)map + sizeof(*h);
+	sc->len = sb.st_size - sizeof(*h);
+	sc->count = h->count;
+
+	return 0;
+}
+
+/*
+ * Write the sidecar to a temporary file first and rename it into place,
+ * so concurrent readers never see a partial file.
+ */
+int
+sidecar_write(const struct dc_index *idx, const char *ext, const char *magic,
+    uint32_t version, size_t count, const struct iovec *iov, int iovcnt)
+{
+	struct sidecar_hdr h;
+	const char *p;
+	char *path = NULL, *tmp = NULL;
+	size_t len;
+	ssize_t n;
+	int fd = -1, made = 0, i;
+
+	if (idx->path == NULL || !idx->writable)
+		return -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, magic, sizeof(h.magic));
+	h.version = version;
+	h.src_size = idx->size;
+	h.src_sec = idx->mtime.tv_sec;
+	h.src_nsec = idx->mtime.tv_nsec;
+	h.count = count;
+
+	if (asprintf(&path, "%s%s", idx->path, ext) == -1) {
+		path = NULL;
+		goto fail;
+	}
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1) {
+		tmp = NULL;
+		goto fail;
+	}
+	if ((fd = mkstemp(tmp)) == -1)
+		goto fail;
+	made = 1;
+	if (fchmod(fd, 0644) == -1)
+		goto fail;
+	if (write(fd, &h, sizeof(h)) != sizeof(h))
+		goto fail;
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		len = iov[i].iov_len;
+		while (len > 0) {
+			if ((n = write(fd, p, len)) == -1) {
+				if (errno == EINTR)
+					continue;
+				goto fail;
+			}
+			p += n;
+			len -= n;
+		}
+	}
+
+	if (close(fd) == -1) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmp, path) == -1)
+		goto fail;
+
+	free(tmp);
+	free(path);
+	return 0;
+
+ fail:
+	if (fd != -1)
+		close(fd);
+	if (made)
+		unlink(tmp);
+	free(tmp);
+	free(path);
+	return -1;
+}
+
+void
+sidecar_close(struct dc_sidecar *sc)
+{
+	if (sc->map != NULL)
+		munmap(sc->map, sc->maplen);
+	memset(sc, 0, sizeof(*sc));
+}
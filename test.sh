@@ -3,32 +3,42 @@ set -e
 
 function cleanup {
   rm "$tmp"
+  rm -rf "$tdir"
 }
 tmp=$(mktemp)
+tdir=$(mktemp -d)
 trap cleanup EXIT
 
 if [ "$(uname)" = Linux ]; then
 	ncpu=$(grep siblings /proc/cpuinfo  | tail -1 | cut -d: -f2)
 	DICT=./dict
+	DICTIDX=$PWD/dictidx
+	DICTCONV=./dictconv
 else
 	ncpu=$(sysctl -n hw.ncpuonline)
 	DICT=./obj/dict
+	DICTIDX=$PWD/obj/dictidx
+	DICTCONV=./obj/dictconv
 fi
 
 if command -v mandoc > /dev/null; then
 	echo check SYNOPSIS and usage are equal
-	synopsis=$(mandoc -Tmarkdown dict.1  | \
-	    sed -n '/^# SYNOPSIS/{x;d;};H;/^# DESCRIPTION/{x;p;};' | \
-	    sed -e 's/[\*\\]//g' -e 's/&nbsp;/ /g' -e 's/^#.*//g' | \
-	    tail +2 | tr '\n' ' ' | cut -d# -f1)
-	synopsis=${synopsis%%+( )}
-	usage=$($DICT -h 2>&1 | cut -d: -f2 | tail +2)
-	usage=${usage%%+( )}
-	if [ "$usage" != "$synopsis" ]; then
-		echo "usage != synopsis: '$usage' != '$synopsis'"
-		exit 1
-	fi
-	echo .
+	for p in "dict.1 $DICT" "dictidx.1 $DICTIDX" "dictconv.1 $DICTCONV"; do
+		set -- $p
+		synopsis=$(mandoc -Tmarkdown $1  | \
+		    sed -n '/^# SYNOPSIS/{x;d;};H;/^# DESCRIPTION/{x;p;};' | \
+		    sed -e 's/[\*\\]//g' -e 's/&nbsp;/ /g' -e 's/^#.*//g' | \
+		    tail +2 | tr '\n' ' ' | cut -d# -f1 | tr -s ' ' | \
+		    sed -e 's/^ //' -e 's/ $//')
+		usage=$($2 -h 2>&1 | tail +2 | sed -e 's/^usage://' | \
+		    tr '\n' ' ' | tr -s ' ' | sed -e 's/^ //' -e 's/ $//')
+		if [ "$usage" != "$synopsis" ]; then
+			echo "usage != synopsis: '$usage' != '$synopsis'"
+			exit 1
+		fi
+		echo -n .
+	done
+	echo
 fi
 
 echo verify all index files
@@ -55,6 +65,34 @@ for f in /usr/local/freedict/*; do
 done
 echo
 
+echo lookup every word in batch mode
+for f in /usr/local/freedict/*; do
+	b=$(basename "$f");
+	echo -n .
+	cut -d'	' -f1 "$f/$b.index" | grep -v '^$' | uniq > "$tmp"
+	idx=$(cat "$tmp" | wc -l)
+	dct=$(tr \\n \\0 < "$tmp" | $DICT -VebD "$b" | wc -l)
+	if [ "$idx" -ne "$dct" ]; then
+		echo "$b: $idx vs $dct"
+		exit 1
+	fi
+done
+echo
+
+echo lookup every word as a suffix
+for f in /usr/local/freedict/*; do
+	b=$(basename "$f");
+	echo -n .
+	cut -d'	' -f1 "$f/$b.index" | grep -v '^$' | uniq > "$tmp"
+	idx=$(cat "$tmp" | wc -l)
+	dct=$(tr \\n \\0 < "$tmp" | $DICT -bD "$b" -t suffix | sort -u | wc -l)
+	if [ "$idx" -ne "$dct" ]; then
+		echo "$b: $idx vs $dct"
+		exit 1
+	fi
+done
+echo
+
 echo lookup between every word
 for f in /usr/local/freedict/*; do
 	b=$(basename "$f");
@@ -88,3 +126,218 @@ for f in /usr/local/freedict/*; do
 	fi
 done
 echo
+
+echo build a test dictionary
+mkdir "$tdir/t"
+printf 'robert\tname\nrupert\tname\nrob\tshort name\nrubin\tname\n' > "$tdir/t.tab"
+printf 'ashcraft\tname\nhouse\ta building\nhouse\tthe house\n' >> "$tdir/t.tab"
+printf 'mouse\tan animal\nlighthouse\ta tower\n' >> "$tdir/t.tab"
+(cd "$tdir/t" && $DICTIDX -s ../t.tab t)
+echo .
+
+echo lookup several soundex codes at once
+dct=$(DICT_PATH=$tdir $DICT -D t -t soundex robert rob ashcroft | sort)
+if [ "$dct" != "$(printf -- '- ashcraft\n- rob\n- robert\n- rupert')" ]; then
+	echo "soundex: $dct"
+	exit 1
+fi
+echo .
+
+echo match within a Levenshtein distance
+dct=$(DICT_PATH=$tdir $DICT -D t -f 1 robin house)
+if [ "$dct" != "$(printf -- '- rubin\n- house\n- mouse')" ]; then
+	echo "lev 1: $dct"
+	exit 1
+fi
+dct=$(DICT_PATH=$tdir $DICT -D t -f 2 robin)
+if [ "$dct" != "$(printf -- '- rob\n- rubin')" ]; then
+	echo "lev 2: $dct"
+	exit 1
+fi
+echo .
+
+echo page through the matches
+dct=$(DICT_PATH=$tdir $DICT -D t -o 1 -l 2 r)
+if [ "$dct" != "$(printf -- '- robert\n- rubin')" ]; then
+	echo "page: $dct"
+	exit 1
+fi
+dct=$(DICT_PATH=$tdir $DICT -D t -d -o 1 house)
+if [ "$dct" != "$(printf -- '- house\n  the house')" ]; then
+	echo "page: $dct"
+	exit 1
+fi
+echo .
+
+echo define an entry longer than a line buffer
+mkdir -p "$tdir/long/l"
+awk 'BEGIN {
+	printf "long\t"
+	for (i = 1; i <= 300; i++)
+		printf "%sline %d of a long definition",
+		    (i > 1 ? "\\n" : ""), i
+	printf "\nshort\tx\n"
+}' > "$tdir/l.tab"
+(cd "$tdir/long/l" && $DICTIDX -c 1024 ../../l.tab l)
+awk 'BEGIN {
+	print "- long"
+	for (i = 1; i <= 300; i++)
+		printf "  line %d of a long definition\n", i
+}' > "$tdir/l.exp"
+for c in "" "-c 1"; do
+	DICT_PATH=$tdir/long $DICT -D l $c -ed long | diff -u "$tdir/l.exp" -
+done
+echo .
+
+echo materialize only with a cache directory
+if env -i DICT_PATH=$tdir $DICT -D t -M 2> /dev/null; then
+	echo "materialized without a cache"
+	exit 1
+fi
+echo .
+
+if command -v nc > /dev/null; then
+	echo serve the test dictionary
+	DICT_PATH=$tdir $DICT -S "$tdir/sock" &
+	pid=$!
+	while [ ! -S "$tdir/sock" ]; do sleep 0.1; done
+	printf 'SHOW DB\r\nSHOW STRAT\r\nDEFINE t rob\r\nDEFINE * house\r\n' \
+	    > "$tmp"
+	printf 'MATCH t prefix ro\r\nMATCH t exact nothere\r\n' >> "$tmp"
+	printf 'MATCH t re "("\r\nQUIT\r\n' >> "$tmp"
+	nc -U "$tdir/sock" < "$tmp" | tr -d '\r' > "$tdir/srv.out"
+	kill $pid
+	wait $pid || true
+	cat > "$tdir/srv.exp" <<-EOF
+	220
+	110 1 databases present
+	t "t"
+	.
+	250 ok
+	111 8 strategies available
+	exact "Match headwords exactly"
+	prefix "Match prefixes"
+	suffix "Match suffixes"
+	soundex "Match using SOUNDEX algorithm"
+	lev "Match headwords within a Levenshtein distance"
+	substring "Match substrings"
+	re "POSIX 1003.2 (modern) regular expressions"
+	glob "Match headwords with a shell pattern"
+	.
+	250 ok
+	150 1 definitions retrieved
+	151 "rob" t "t"
+	rob
+	  short name
+	.
+	250 ok
+	150 2 definitions retrieved
+	151 "house" t "t"
+	house
+	  a building
+	.
+	151 "house" t "t"
+	house
+	  the house
+	.
+	250 ok
+	152 2 matches found
+	t "rob"
+	t "robert"
+	.
+	250 ok
+	552 no match
+	501 syntax error, illegal parameters
+	221 bye
+	EOF
+	sed -e '1s/^220 .*/220/' "$tdir/srv.out" | diff -u "$tdir/srv.exp" -
+	echo .
+fi
+
+echo merge an overlay into every strategy
+mkdir "$tdir/o" "$tdir/r"
+(cd "$tdir/o" && $DICTIDX ../t.tab o)
+printf 'house\t\nhome\ta place\nmouse\ta device\nrob\t\nrob\tto steal\n' \
+    > "$tdir/a.tab"
+(cd "$tdir/o" && $DICTIDX -a ../a.tab o)
+# the same entries without an overlay
+grep -v -e '^house	' -e '^rob	' "$tdir/t.tab" > "$tdir/r.tab"
+printf 'home\ta place\nmouse\ta device\nrob\tto steal\n' >> "$tdir/r.tab"
+(cd "$tdir/r" && $DICTIDX ../r.tab r)
+words="house home mouse rob robert ouse ho r ob e rubn"
+for compact in no yes; do
+	for s in exact prefix suffix soundex lev substring re glob; do
+		echo -n .
+		o=$(DICT_PATH=$tdir $DICT -D o -t $s $words)
+		r=$(DICT_PATH=$tdir $DICT -D r -t $s $words)
+		if [ "$o" != "$r" ]; then
+			echo "$s: '$o' != '$r'"
+			exit 1
+		fi
+	done
+	o=$(DICT_PATH=$tdir $DICT -D o -d $words)
+	r=$(DICT_PATH=$tdir $DICT -D r -d $words)
+	if [ "$o" != "$r" ]; then
+		echo "define: '$o' != '$r'"
+		exit 1
+	fi
+	if [ $compact = no ]; then
+		(cd "$tdir/o" && $DICTIDX -C o)
+		if [ -e "$tdir/o/o.delta.index" ]; then
+			echo "o.delta.index was not removed"
+			exit 1
+		fi
+	fi
+done
+echo
+
+echo narrow patterns by their literal prefix
+mkdir -p "$tdir/pat/p" "$tdir/pat/q"
+for w in a ab abb abc aab b ba bab cab house hose horse hse whose xab; do
+	printf '%s\tdef\n' $w
+done > "$tdir/p.tab"
+# with and without a line table
+(cd "$tdir/pat/p" && $DICTIDX -s ../../p.tab p)
+(cd "$tdir/pat/q" && $DICTIDX ../../p.tab q)
+cut -f1 "$tdir/pat/p/p.index" > "$tdir/p.words"
+for d in p q; do
+	for p in '^ab*' '^a{0,1}b' '^(ab)' 'a|b' 'h*se' '^h.*e$' 'ab$'; do
+		echo -n .
+		dct=$(DICT_PATH=$tdir/pat $DICT -D $d -r "$p" | sed 's/^- //')
+		scan=$(grep -E "$p" "$tdir/p.words" || true)
+		if [ "$dct" != "$scan" ]; then
+			echo "re $p: '$dct' != '$scan'"
+			exit 1
+		fi
+	done
+	for p in 'h*se' 'ab*' 'a?b' '[ab]b*' '*b'; do
+		echo -n .
+		dct=$(DICT_PATH=$tdir/pat $DICT -D $d -t glob "$p" | \
+		    sed 's/^- //')
+		scan=$(while read w; do
+			case $w in $p) echo "$w";; esac
+		done < "$tdir/p.words")
+		if [ "$dct" != "$scan" ]; then
+			echo "glob $p: '$dct' != '$scan'"
+			exit 1
+		fi
+	done
+done
+echo
+
+echo lookup every word through the filter
+mkdir "$tdir/b"
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "w%d\tdef %d\n", i * 7, i }' \
+    > "$tdir/b.tab"
+(cd "$tdir/b" && $DICTIDX -F 100 ../b.tab b)
+cut -f1 "$tdir/b.tab" | sed -e 'p' -e 's/$/x/' > "$tmp"
+with=$(DICT_PATH=$tdir $DICT -D b -ebd < "$tmp")
+filtered=$(DICT_PATH=$tdir $DICT -D b -ebs < "$tmp" 2>&1 >/dev/null | \
+    sed -n 's/.* \([0-9]*\) filtered$/\1/p')
+rm "$tdir/b/b.index.bloom"
+without=$(DICT_PATH=$tdir $DICT -D b -ebd < "$tmp")
+if [ "$with" != "$without" ] || [ "$filtered" -lt 19000 ]; then
+	echo "b: filter lost words or filtered $filtered of 20000 misses"
+	exit 1
+fi
+echo .